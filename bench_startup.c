@@ -0,0 +1,128 @@
+/* ind/bench_startup.c
+ *
+ * Measure how much ind adds to the wall time of starting a command.
+ *
+ * Runs "<command>" and "ind <command>" (default command: true) many times
+ * each, with stdin/stdout/stderr on /dev/null, and prints the mean time per
+ * invocation and the difference.
+ *
+ * usage: bench_startup [ -n <runs> ] [ -i <path to ind> ] [ <command> ... ]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Run argv n times, return mean wall time in microseconds.
+ */
+static double
+run(char **argv, int n)
+{
+  double start;
+  int devnull;
+  int c;
+
+  if (0 > (devnull = open("/dev/null", O_RDWR))) {
+    fprintf(stderr, "bench_startup: /dev/null: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  start = now();
+  for (c = 0; c < n; c++) {
+    pid_t pid;
+    int status;
+
+    switch ((pid = fork())) {
+    case 0:
+      dup2(devnull, STDIN_FILENO);
+      dup2(devnull, STDOUT_FILENO);
+      dup2(devnull, STDERR_FILENO);
+      execvp(argv[0], argv);
+      _exit(127);
+    case -1:
+      fprintf(stderr, "bench_startup: fork(): %s\n", strerror(errno));
+      exit(1);
+    }
+    if (-1 == waitpid(pid, &status, 0)) {
+      fprintf(stderr, "bench_startup: waitpid(): %s\n", strerror(errno));
+      exit(1);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+      fprintf(stderr, "bench_startup: %s failed (status %d)\n",
+              argv[0], status);
+      exit(1);
+    }
+  }
+  close(devnull);
+  return (now() - start) * 1e6 / n;
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *ind = "./ind";
+  char *deftrue[] = { "true", NULL };
+  char **cmd = deftrue;
+  char **indcmd;
+  double plain, wrapped;
+  int runs = 2000;
+  int ncmd;
+  int c;
+
+  while (-1 != (c = getopt(argc, argv, "+hn:i:"))) {
+    switch (c) {
+    case 'n':
+      runs = atoi(optarg);
+      break;
+    case 'i':
+      ind = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [ -n <runs> ] [ -i <ind> ] [ <command> ... ]\n",
+              argv[0]);
+      return c != 'h';
+    }
+  }
+  if (runs < 1) {
+    runs = 1;
+  }
+  if (optind < argc) {
+    cmd = &argv[optind];
+  }
+
+  for (ncmd = 0; cmd[ncmd]; ncmd++);
+  if (!(indcmd = malloc((ncmd + 2) * sizeof(char *)))) {
+    fprintf(stderr, "bench_startup: out of memory\n");
+    return 1;
+  }
+  indcmd[0] = (char *)ind;
+  memcpy(&indcmd[1], cmd, (ncmd + 1) * sizeof(char *));
+
+  /* warm up caches and the dynamic linker */
+  run(cmd, 10);
+  run(indcmd, 10);
+
+  plain = run(cmd, runs);
+  wrapped = run(indcmd, runs);
+
+  printf("runs:          %d\n", runs);
+  printf("%-14s %8.1f us\n", cmd[0], plain);
+  printf("%-14s %8.1f us\n", "ind", wrapped);
+  printf("%-14s %8.1f us\n", "overhead", wrapped - plain);
+  return 0;
+}
@@ -0,0 +1,324 @@
+/* ind/format.c - prefix/postfix templates
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "format.h"
+
+/* arbitrary maxlength for prefixes and postfixes. Should be enough */
+const size_t max_indstr_length = 1048576;
+
+struct format_vars format_vars = { "-", "-", "-" };
+unsigned format_vars_gen = 0;
+
+/* the shortest directive, "%{cpu}", is more than a quarter as long as the
+ * longest value, so expanding them at most quadruples the length */
+#define FORMAT_VARS_GROWTH 4
+
+/**
+ * just like strpbrk(), but haystack is not null-terminated
+ *
+ * @param  p:       string to search in
+ * @param  chars:   characters to look for
+ * @param  len:     length of string to search in
+ *
+ * @return   Pointer to first occurance of any of the characters, or NULL
+ *           if not found.
+ */
+char *
+mempbrk(const char *p, const char *chars, size_t len)
+{
+  int c;
+  char *ret = NULL;
+  char *tmp;
+
+  for(c = strlen(chars); c; c--) {
+    tmp = memchr(p, chars[c-1], len);
+    if (tmp && (!ret || tmp < ret)) {
+      ret = tmp;
+    }
+  }
+  return ret;
+}
+
+/**
+ * Look up a %{name} directive.
+ *
+ * @param   name:    what's after the "%{"
+ * @param   len:     set to the length of the whole directive
+ *
+ * @return  its value, or NULL if it's not one
+ */
+static const char *
+format_var(const char *name, size_t *len)
+{
+  static const struct {
+    const char *name;
+    const char *value;
+  } vars[] = {
+    { "rss}", format_vars.rss },
+    { "cpu}", format_vars.cpu },
+    { "threads}", format_vars.threads },
+  };
+  size_t c;
+
+  for (c = 0; c < sizeof(vars) / sizeof(vars[0]); c++) {
+    size_t n = strlen(vars[c].name);
+    if (!strncmp(name, vars[c].name, n)) {
+      *len = n + 2;
+      return vars[c].value;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @return  !0 if fmt has %{...} directives, which the caller must then
+ *          keep format_vars up to date for
+ */
+int
+format_uses_vars(const char *fmt)
+{
+  const char *p;
+
+  for (p = fmt; (p = strchr(p, '%')); p += 2) {
+    if (p[1] == '{') {
+      return 1;
+    }
+    if (!p[1]) {
+      break;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Replace the %{...} directives with their values, leaving the rest for
+ * strftime().
+ *
+ * @param   in:      format string
+ * @param   out:     at least FORMAT_VARS_GROWTH * strlen(in) + 1 bytes
+ *
+ * @return  0 on success, -1 if there's an unknown %{...}
+ */
+static int
+format_expand(const char *in, char *out)
+{
+  const char *val;
+  size_t len;
+
+  while (*in) {
+    if (in[0] != '%') {
+      *out++ = *in++;
+    } else if (in[1] != '{') {
+      /* %% must stay in one piece so %%{ isn't taken for a directive */
+      *out++ = *in++;
+      if (*in) {
+        *out++ = *in++;
+      }
+    } else if ((val = format_var(in + 2, &len))) {
+      size_t n = strlen(val);
+      memcpy(out, val, n);
+      out += n;
+      in += len;
+    } else {
+      return -1;
+    }
+  }
+  *out = 0;
+  return 0;
+}
+
+/**
+ * return malloc()ed and created string, caller calls free()
+ * exit(1)s on failure (malloc() failed)
+ *
+ * @param   fmt:     format string, as specified in the manpage (%c is ctime
+ *                   for example)
+ * @param   bail:    Bail if format string is broken
+ * @param   output:  place to store the output string pointer at
+ */
+void
+format(const char *infmt, char **output, int bail)
+{
+  if (!*infmt) {
+    *output = malloc(1);
+    assert(*output);
+    **output = 0;
+    return;
+  }
+
+  /* nothing to expand, so don't pay for localtime() checking the
+   * timezone file */
+  if (!strchr(infmt, '%')) {
+    if (!(*output = strdup(infmt))) {
+      fprintf(stderr, "ind: Memory alloc of %zd bytes failed!\n",
+              strlen(infmt) + 1);
+      exit(1);
+    }
+    return;
+  }
+
+  /* We need to inject a space as the first character in order to differentiate
+   * %p expanding to an empty string and an error, since strftime() sucks at
+   * error handling */
+  char fmt[FORMAT_VARS_GROWTH * strlen(infmt) + 2];
+  fmt[0] = ' ';
+  if (format_expand(infmt, &fmt[1])) {
+    if (bail) {
+      fprintf(stderr, "ind: Format string '%s' has an unknown %%{...}.\n",
+              infmt);
+      exit(1);
+    }
+    /* fmt may be too short to hold this */
+    if (!(*output = strdup("ind fmt error"))) {
+      fprintf(stderr, "ind: Memory alloc of a <20 bytes failed!\n");
+      exit(1);
+    }
+    return;
+  }
+
+  char *buf = 0;
+  size_t bufn = 2;
+  for (;;) {
+    time_t t;
+    char *newbuf;
+    size_t n;
+
+    if (!(newbuf = realloc(buf, bufn))) {
+      fprintf(stderr, "ind: Memory alloc of %zd bytes failed!\n", bufn);
+      exit(1);
+    }
+    buf = newbuf;
+
+    struct tm tm;
+    time(&t);
+    memcpy(&tm, localtime(&t), sizeof(tm));
+    if ((n = strftime(buf, bufn, fmt, &tm))) {
+      break;
+    }
+
+    bufn *= 2;
+    if (bufn > max_indstr_length) {
+      /* Format expanded to too long a string, or is incorrectly formatted.
+       * in either case it's a user error or madness. */
+      if (bail) {
+        fprintf(stderr, "ind: Format string '%s' is broken.\n", fmt);
+        exit(1);
+      }
+
+      free(buf);
+      buf = strdup("ind fmt error");
+      if (!buf) {
+        fprintf(stderr, "ind: Memory alloc of a <20 bytes failed!\n");
+        exit(1);
+      }
+      break;
+    }
+  }
+  /* drop the space, keeping the NUL */
+  memmove(buf, buf + 1, strlen(buf));
+  *output = buf;
+}
+
+/**
+ * Classify a prefix or postfix, and expand it.
+ *
+ * @param   t:       template to set up
+ * @param   fmt:     format string, which must outlive t
+ * @param   bail:    exit(1) if the format string is broken
+ */
+void
+template_init(struct template *t, const char *fmt, int bail)
+{
+  t->fmt = fmt;
+  t->kind = format_kind(fmt);
+  format(fmt, &t->text, bail);
+  t->len = strlen(t->text);
+  t->made = time(NULL);
+  t->gen = format_vars_gen;
+}
+
+/**
+ * Does fmt expand to the same thing every time?
+ *
+ * @return  TEMPLATE_*
+ */
+int
+format_kind(const char *fmt)
+{
+  const char *p;
+
+  for (p = fmt; (p = strchr(p, '%')); p += 2) {
+    if (p[1] != '%') {
+      return TEMPLATE_DYNAMIC;
+    }
+  }
+  return *fmt ? TEMPLATE_CONST : TEMPLATE_EMPTY;
+}
+
+/**
+ * Expand a TEMPLATE_DYNAMIC again if what it shows may have changed.
+ * strftime() has nothing finer than seconds, so once a second is enough.
+ */
+void
+template_update(struct template *t)
+{
+  time_t now;
+
+  if (t->kind != TEMPLATE_DYNAMIC) {
+    return;
+  }
+  now = time(NULL);
+  if (now == t->made && t->gen == format_vars_gen) {
+    return;
+  }
+  free(t->text);
+  format(t->fmt, &t->text, 0);
+  t->len = strlen(t->text);
+  t->made = now;
+  t->gen = format_vars_gen;
+}
+
+/**
+ * Free what template_init() allocated.
+ */
+void
+template_free(struct template *t)
+{
+  free(t->text);
+  t->text = NULL;
+}
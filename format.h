@@ -0,0 +1,74 @@
+/* ind/format.h - prefix/postfix templates
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef IND_FORMAT_H
+#define IND_FORMAT_H
+
+#include <stddef.h>
+#include <time.h>
+
+extern const size_t max_indstr_length;
+
+/* what %{rss}, %{cpu} and %{threads} expand to. The caller keeps them up
+ * to date; format() only copies them. */
+struct format_vars {
+  char rss[16];          /* resident set size, e.g. 12.3M */
+  char cpu[16];          /* CPU use in percent, e.g. 97.5 */
+  char threads[16];
+};
+extern struct format_vars format_vars;
+extern unsigned format_vars_gen;  /* bumped when format_vars change */
+
+/* what a prefix or postfix needs done to it per line */
+enum {
+  TEMPLATE_EMPTY,        /* nothing */
+  TEMPLATE_CONST,        /* no directives but %%: expanded once */
+  TEMPLATE_DYNAMIC,      /* expanded again each second, or when
+                          * format_vars change */
+};
+
+/* a prefix or postfix, and what it expands to now */
+struct template {
+  const char *fmt;
+  int kind;              /* TEMPLATE_* */
+  char *text;            /* malloc()ed */
+  size_t len;
+  time_t made;           /* TEMPLATE_DYNAMIC: the second it's for */
+  unsigned gen;          /* and the format_vars_gen */
+};
+
+char *mempbrk(const char *p, const char *chars, size_t len);
+int format_uses_vars(const char *fmt);
+int format_kind(const char *fmt);
+void format(const char *infmt, char **output, int bail);
+void template_init(struct template *t, const char *fmt, int bail);
+void template_update(struct template *t);
+void template_free(struct template *t);
+
+#endif
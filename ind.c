@@ -36,6 +36,11 @@
 #include "config.h"
 #endif
 
+/* sendmmsg() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -51,6 +56,16 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #ifdef HAVE_UTIL_H
 #include <util.h>
@@ -68,7 +83,32 @@
 #include <alloca.h>
 #endif
 
+#ifdef IND_INJECT_LIB
+#include <elf.h>
+#endif
+
+#if defined(HAVE_SPAWN_H) && defined(HAVE_POSIX_SPAWNP)
+#include <spawn.h>
+#define IND_USE_SPAWN 1
+extern char **environ;
+#endif
+
 #include "pty_solaris.h"
+#include "json.h"
+#include "format.h"
+#include "record.h"
+#include "logindex.h"
+#include "screen.h"
+#include "width.h"
+#include "probes.h"
+#include "trace.h"
+#include "perf.h"
+
+#ifdef __GNUC__
+#define NORETURN __attribute__((noreturn))
+#else
+#define NORETURN
+#endif
 
 /* Needed for IRIX */
 #ifndef STDIN_FILENO
@@ -81,13 +121,285 @@
 #define STDERR_FILENO   2
 #endif
 
-/* arbitrary maxlength for prefixes and postfixes. Should be enough */
-static const size_t max_indstr_length = 1048576;
-
 static const char *argv0;
 static const char *version = PACKAGE_VERSION;
 static int verbose = 0;
 static int sig_winch_counter = 0;
+static int json_output = 0;
+static int inject = 0;
+static int line_atomic = 0;
+static long line_hold_ms = 100;
+static size_t line_max = 65536;
+static struct rec_writer *recorder = NULL;
+static struct tracer *tracer = NULL;     /* --trace-file */
+static int extra_stats = 0;              /* count lines and blocked time too */
+static const char *metrics_file = NULL;  /* --metrics-file */
+static int metrics_sock = -1;            /* --metrics-socket */
+static long metrics_interval_ms = 10000; /* --metrics-interval */
+static struct timespec metrics_written;
+static int status_mode = 0;              /* --status, STATUS_* */
+static int status_rows;                  /* STATUS_BOTTOM: terminal size */
+static int status_cols;
+static int status_shown = 0;             /* STATUS_STDERR: line is up */
+static struct sink *status_share[2];     /* sinks writing to its terminal */
+static struct timespec status_start;
+static struct timespec status_drawn;
+static int rusage_report = 0;            /* --rusage */
+static int perf_report_on = 0;          /* --perf-counters */
+static int proc_vars = 0;                /* a prefix has %{rss} etc */
+static struct timespec proc_sampled;
+static unsigned long long proc_ticks;    /* its utime + stime then */
+static int perf_sync[2] = { -1, -1 };   /* child waits for its counters */
+static int record_stdin = 0;
+static char syslog_tag[320] = "- - -";  /* RFC 5424 HOSTNAME APP-NAME PROCID */
+static struct screen *screen = NULL;     /* --screen */
+static const char *screen_prefix;
+static struct timespec screen_rendered;
+static int wrap = 0;                     /* --wrap */
+static const char *wrap_marker = NULL;   /* --wrap-marker, or the prefix */
+static struct template wrap_template;    /* wrap_marker, expanded */
+static long drain_timeout_ms = -1;       /* --drain-timeout, -1 for none */
+static int sigchld_pipe[2] = { -1, -1 }; /* SIGCHLD handler -> main loop */
+
+IND_PROBE_SEMAPHORE(read);
+IND_PROBE_SEMAPHORE(prefix);
+IND_PROBE_SEMAPHORE(write);
+IND_PROBE_SEMAPHORE(wakeup);
+IND_PROBE_SEMAPHORE(resize);
+IND_PROBE_SEMAPHORE(exit);
+
+/* --status: where the status line goes */
+enum {
+  STATUS_OFF,
+  STATUS_BOTTOM,         /* last row of stdout's terminal, kept out of the
+                          * scroll region */
+  STATUS_STDERR,         /* on stderr, between lines of output */
+};
+
+/* --status: redraw this often */
+#define STATUS_INTERVAL_MS 250
+
+/* --screen: redraw at most this often */
+#define SCREEN_FRAME_MS 16
+
+/* %{rss}, %{cpu}, %{threads}: look at the command this often */
+#define PROC_INTERVAL_MS 250
+
+/* long options without a short equivalent */
+enum {
+  OPT_VERSION = 256,
+  OPT_COPYING,
+  OPT_JSON,
+  OPT_INJECT,
+  OPT_LINE_ATOMIC,
+  OPT_LINE_HOLD,
+  OPT_LINE_MAX,
+  OPT_RECORD,
+  OPT_RECORD_STDIN,
+  OPT_REPLAY,
+  OPT_SPEED,
+  OPT_SINK,
+  OPT_SYSLOG,
+  OPT_SINK_POLICY,
+  OPT_SINK_BUFFER,
+  OPT_SINK_STREAMS,
+  OPT_SINK_JSON,
+  OPT_SINK_PREFIX,
+  OPT_SINK_POSTFIX,
+  OPT_SINK_EPREFIX,
+  OPT_SINK_EPOSTFIX,
+  OPT_SINK_STRIP,
+  OPT_INDEX_LINES,
+  OPT_INDEX_MS,
+  OPT_LOG,
+  OPT_SEEK_TIME,
+  OPT_SCREEN,
+  OPT_STRIP,
+  OPT_WRAP,
+  OPT_WRAP_MARKER,
+  OPT_PRIORITY,
+  OPT_READ_BUDGET,
+  OPT_DRAIN_TIMEOUT,
+  OPT_TRACE_FILE,
+  OPT_METRICS_FILE,
+  OPT_METRICS_SOCKET,
+  OPT_METRICS_INTERVAL,
+  OPT_STATUS,
+  OPT_RUSAGE,
+  OPT_PERF_COUNTERS,
+  OPT_GAP_REPORT,
+  OPT_NEST,
+};
+
+/* the child's output streams */
+enum {
+  STREAM_STDOUT,
+  STREAM_STDERR,
+  NSTREAMS
+};
+static const char *stream_names[NSTREAMS] = { "stdout", "stderr" };
+
+/* reads from the command are up to this big */
+#define READ_SIZE 65536
+
+/* how reading one of the command's streams has gone, for -v, metrics
+ * and --status */
+struct stream_stats {
+  unsigned long long reads;
+  unsigned long long bytes;
+  unsigned long long lines;  /* only counted with extra_stats */
+  int waiting;           /* seen readable and not read since */
+  struct timespec since; /* when it was first seen readable */
+  long long max_delay;   /* longest wait from readable to read, in us */
+};
+static struct stream_stats stream_stats[NSTREAMS];
+static int read_first = STREAM_STDERR;  /* --priority, -1 to take turns */
+static unsigned read_budget = 16;       /* --read-budget */
+
+/* --gap-report: this much of the lines around a gap is kept */
+#define GAP_TEXT 60
+
+/* a silence between two lines of a stream */
+struct gap {
+  long long ns;          /* how long */
+  long long at;          /* when it ended, ns since the command started */
+  int id;                /* which stream */
+  char before[GAP_TEXT + 1];
+  char after[GAP_TEXT + 1];
+};
+static unsigned gap_max = 0;            /* --gap-report: how many to keep */
+static struct gap *gaps;                /* min-heap on ns */
+static unsigned gap_n = 0;
+static long long gap_epoch;             /* when the command started */
+static struct {
+  long long end;                        /* when the last line ended, or 0 */
+  char last[GAP_TEXT + 1];              /* that line */
+  char cur[GAP_TEXT + 1];               /* the one coming in */
+  size_t curlen;
+} gap_streams[NSTREAMS];
+
+/* what to do when a sink can't keep up */
+enum sink_policy {
+  SINK_BLOCK,            /* stop everything until it catches up */
+  SINK_DROP,             /* drop whole lines until it catches up */
+  SINK_DISCONNECT,       /* close it */
+};
+
+/* dropping[] states */
+enum {
+  DROP_NONE,
+  DROP_LINE,             /* dropping the whole current line */
+  DROP_REST,             /* line was cut short, keep only its terminator */
+};
+
+/* syslog records are cut at this size, and sent this many per sendmmsg() */
+#define SYSLOG_MAX_MSG 8192
+#define SYSLOG_BATCH 64
+
+/* non-blocking sinks are written when the command goes quiet, or when
+ * this much is queued */
+#define SINK_BATCH_BYTES 65536
+
+/* stdin is forwarded this much at a time, unless it's a terminal. Same as
+ * the default pipe capacity on Linux. */
+#define FORWARD_BULK 65536
+#define FORWARD_EPIPE (-2)
+
+/* partial line carried over between reads, for sinks that need whole lines */
+struct linebuf {
+  char *buf;
+  size_t len;
+  size_t size;
+};
+
+/* --wrap: where on the terminal line one of the child's streams is */
+struct wrapper {
+  struct vt_parser vt;   /* so escape sequences take no room */
+  struct sink *sk;
+  int col;               /* column the next character goes to */
+  int limit;             /* columns available, not counting the postfix */
+  uint32_t ucs;          /* UTF-8 character being decoded */
+  int uneed;             /* continuation bytes still to come */
+  const char *lead;      /* start of that character, NULL if in an
+                          * earlier chunk */
+  const char *done;      /* written up to here */
+  const char *cont;      /* put at the start of continuation lines */
+  int contcols;          /* columns it takes */
+  const char *post;
+};
+
+struct sink;
+
+/* adds prefixes and postfixes to text, see sink_text_lines() */
+typedef void sink_text_fn(struct sink *sk, int id, const char *p, size_t n);
+
+/**
+ * A destination for annotated output. The terminal is one sink for
+ * stdout and one for stderr; --sink adds more, each with its own
+ * templates, buffer and overflow policy.
+ */
+struct sink {
+  struct sink *next;
+  const char *name;      /* path, or "stdout"/"stderr" for ind's own */
+  int fd;                /* -1 once disconnected */
+  int blocking;          /* fd is shared with others, can't be non-blocking */
+  unsigned streams;      /* bitmask of (1 << STREAM_x) written here */
+  const char *prefix[NSTREAMS];
+  const char *postfix[NSTREAMS];
+  struct template pre[NSTREAMS];   /* the same, classified and expanded */
+  struct template post[NSTREAMS];
+  sink_text_fn *text[NSTREAMS];    /* the sink_text_*() for them */
+  int json;              /* JSON Lines records instead of text */
+  int syslog;            /* RFC 5424 datagrams instead of text */
+  enum sink_policy policy;
+  size_t bufmax;         /* fallen behind when this much is buffered */
+  unsigned strip;        /* bitmask of streams to strip escape codes from */
+  struct vt_parser stripper[NSTREAMS];
+  int cols;              /* --wrap: terminal width, 0 for no wrapping */
+  struct wrapper wrapper[NSTREAMS];
+
+  int emptyline[NSTREAMS];     /* nothing written on the current line yet */
+  int cr[NSTREAMS];            /* data ended in CR: 1 if written, -1 if
+                                * dropped. A LF next is part of it. */
+  int dropping[NSTREAMS];      /* DROP_* */
+  struct linebuf line[NSTREAMS];
+
+  /* output not yet written */
+  char *buf;
+  size_t bufoff;
+  size_t buflen;
+  size_t bufsize;
+
+  /* --line-atomic: the first complete bytes of buf end at a line break,
+   * the rest has been held since held_since */
+  size_t complete;
+  int holding;
+  struct timespec held_since;
+
+  /* syslog: lengths of the datagrams in buf, oldest at rec[rechead] */
+  size_t *rec;
+  size_t rechead;
+  size_t nrec;
+  size_t recsize;
+
+  /* --log: sidecar time index */
+  int idxfd;                   /* -1 if not indexed */
+  unsigned long index_lines;   /* add an entry every this many lines. 0
+                                * if this is not a --log */
+  unsigned long index_ms;      /* ... or this often, whichever is first */
+  off_t base;                  /* size of the log when opened */
+  unsigned long long written;  /* bytes written since */
+  unsigned long long lines;    /* finished lines in the log */
+  unsigned long long idx_line; /* line of the last entry */
+  struct timespec idx_time;    /* time of the last entry */
+
+  unsigned long long seq;      /* JSON records written */
+  unsigned long long dropped;  /* lines dropped */
+  unsigned long long blocked_ns; /* time spent waiting to write, with
+                                  * extra_stats */
+};
+
+static struct sink *sinks = NULL;
 
 /**
  * EINTR-safe close()
@@ -173,6 +485,34 @@ do_fdset(fd_set *fds, int fd, int *fdmax)
   *fdmax = *fdmax > fd ? *fdmax : fd;
 }
 
+/**
+ * @return  1 if fd can be read without blocking
+ */
+static int
+fd_readable(int fd)
+{
+  fd_set fds;
+  struct timeval tv = { 0, 0 };
+
+  FD_ZERO(&fds);
+  FD_SET(fd, &fds);
+  return 0 < select(fd + 1, &fds, NULL, NULL, &tv);
+}
+
+/**
+ * Turn a wait() status into an exit code, the way shells do.
+ *
+ * @return  exit code, or 128 + signal number if killed by a signal
+ */
+static int
+exit_code(int status)
+{
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
 /**
  * Just like write(), except it really really writes everything, unless
  * there is a real (non-EINTR) error.
@@ -216,6 +556,10 @@ static void
 print_ttyname(const char *fdname, int fdm, int fds)
 {
   char *tty;
+
+  if (!verbose) {
+    return;
+  }
 #ifdef CONSTANT_PTSMASTER
   if (verbose) {
     fprintf(stderr, "%s: %s pty master name: %s\n",
@@ -252,7 +596,7 @@ print_ttyname(const char *fdname, int fdm, int fds)
  *
  * does not return. Runs execvp() or exit()
  */
-static void
+static void NORETURN
 child(int fdi, int fdo, int fde, char **argv)
 {
   int fdt;
@@ -298,349 +642,3703 @@ child(int fdi, int fdo, int fde, char **argv)
   }
 
   do_close3(fdi, fdo, fde);
+
+  /* --perf-counters: don't exec until they're open */
+  if (0 <= perf_sync[0]) {
+    char ch;
+    while (-1 == read(perf_sync[0], &ch, 1) && errno == EINTR) {
+    }
+    close(perf_sync[0]);
+  }
   execvp(argv[0], argv);
   fprintf(stderr, "%s: %s: %s\n", argv0, argv[0], strerror(errno));
   exit(1);
 }
 
+#ifdef IND_USE_SPAWN
 /**
- * 
+ * Start the subprocess with posix_spawnp() instead of fork() + child().
+ * Only usable when the child gets no terminal, since then there is no
+ * login_tty() to do, only the dup2()s and closes.
  *
- * 
+ * @param   fdi, fdo, fde:  the child's stdin/stdout/stderr
+ * @param   ind:            ind's ends of the same, closed in the child
+ * @param   argv:           argv of subprocess
+ *
+ * @return  pid of the child. Does not return on error.
  */
-static struct termios orig_stdin_tio;
-static int orig_stdin_tio_ok = 0;
-static void
-reset_stdin_terminal()
+static pid_t
+spawn_child(int fdi, int fdo, int fde, const int ind[3], char **argv)
 {
-  if (!orig_stdin_tio_ok) {
-    return;
+  posix_spawn_file_actions_t fa;
+  int closefds[6];
+  pid_t pid;
+  int err;
+  int c, d;
+
+  closefds[0] = fdi;
+  closefds[1] = fdo;
+  closefds[2] = fde;
+  memcpy(&closefds[3], ind, 3 * sizeof(int));
+
+  if ((err = posix_spawn_file_actions_init(&fa))) {
+    fprintf(stderr, "%s: posix_spawn_file_actions_init(): %s\n",
+            argv0, strerror(err));
+    exit(1);
+  }
+  if ((err = posix_spawn_file_actions_adddup2(&fa, fdi, STDIN_FILENO))
+      || (err = posix_spawn_file_actions_adddup2(&fa, fdo, STDOUT_FILENO))
+      || (err = posix_spawn_file_actions_adddup2(&fa, fde, STDERR_FILENO))) {
+    fprintf(stderr, "%s: posix_spawn_file_actions_adddup2(): %s\n",
+            argv0, strerror(err));
+    exit(1);
+  }
+  for (c = 0; c < 6; c++) {
+    if (closefds[c] <= STDERR_FILENO) {
+      continue;
+    }
+    /* closing the same fd twice would fail the whole spawn */
+    for (d = 0; d < c && closefds[d] != closefds[c]; d++);
+    if (d < c) {
+      continue;
+    }
+    if ((err = posix_spawn_file_actions_addclose(&fa, closefds[c]))) {
+      fprintf(stderr, "%s: posix_spawn_file_actions_addclose(): %s\n",
+              argv0, strerror(err));
+      exit(1);
+    }
   }
 
-  /* reset terminal settings */
-  if (tcsetattr(STDIN_FILENO, TCSADRAIN, &orig_stdin_tio)) {
-    fprintf(stderr,
-	    "%s: Unable to restore terminal settings:"
-	    "%s: tcsetattr(STDIN_FILENO, TCSADRAIN, orig): %s",
-	    argv0, argv0, strerror(errno));
+  err = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  if (err) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, argv[0], strerror(err));
+    exit(1);
   }
+  return pid;
 }
+#endif
 
 /**
- * Print usage information and exit
+ * Find cmd in $PATH, the way execvp() would.
  *
- * @param  err: value sent to exit()
+ * @return  malloc()ed path, or NULL if not found
  */
-static void
-usage(int err)
+static char *
+find_in_path(const char *cmd)
 {
-  
-  printf("ind %s, by Thomas Habets <thomas@habets.se>\n"
-	 "usage: %s [ -h ] [ -p <fmt> ] [ -a <fmt> ] [ -P <fmt> ] "
-	 "[ -A <fmt> ]  \n"
-	 "          <command> <args> ...\n"
-	 "\t-a          Postfix stdout (default: \"\")\n"
-	 "\t-A          Postfix stderr (default: \"\")\n"
-	 "\t--copying   Show 3-clause BSD license\n"
-	 "\t-h, --help  Show this help text\n"
-	 "\t-p          Prefix stdout (default: \"  \")\n"
-	 "\t-P          Prefix stderr (default: \">>\") \n"
-	 "\t-v          Verbose (repeat -v to increase verbosity)\n"
-	 "\t--version   Show version\n"
-	 "Format is strftime()-formatted text. Examples:\n"
-         "\t%s -p 'Hello world | '  echo foo\n"
-         "\t => Hello world | foo\n"
-         "\t%s -p '%%F %%T %%Z | '  echo foo\n"
-         "\t => 2011-08-01 16:08:36 BST | foo\n"
-	 , version, argv0, argv0, argv0);
-  exit(err);
-}
+  const char *path;
+  const char *p, *e;
 
-/**
- *
- */
-static void
-printVersion()
-{
-  printf("ind %s\n", version);
-  printf("Copyright (C) 2005-2009 Thomas Habets <thomas@habets.se>\n"
-         "License 3-clause BSD. Run with --copying to see the whole license.\n"
-         "This is free software: you are free to change and "
-         "redistribute it.\n"
-         "There is NO WARRANTY, to the extent permitted by law.\n");
-  exit(0);
-}
+  if (strchr(cmd, '/')) {
+    return strdup(cmd);
+  }
+  if (!(path = getenv("PATH"))) {
+    path = "/bin:/usr/bin";
+  }
+  for (p = path; ; p = e + 1) {
+    size_t dirlen;
+    char *full;
 
-/**
- *
- */
-static void
-printLicense()
-{
-  printf("ind %s\n", version);
-  printf("(BSD license without advertising clause below)\n"
-         "\n"
-         " Copyright (c) 2005-2009 Thomas Habets <thomas@habets.se>. All rights reserved.\n"
-         "\n"
-         " Redistribution and use in source and binary forms, with or "
-         "without\n"
-         " modification, are permitted provided that the following "
-         "conditions\n"
-         " are met:\n"
-         " 1. Redistributions of source code must retain the above copyright\n"
-         "    notice, this list of conditions and the following disclaimer.\n"
-         " 2. Redistributions in binary form must reproduce the above "
-         "copyright\n"
-         "    notice, this list of conditions and the following disclaimer in"
-         " the\n"
-         "    documentation and/or other materials provided with the "
-         "distribution.\n"
-         " 3. The name of the author may not be used to endorse or promote"
-         " products\n"
-         "    derived from this software without specific prior written "
-         "permission.\n"
-         "\n"
-         " THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS "
-         "OR\n"
-         " IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED "
-         "WARRANTIES\n"
-         " OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE "
-         "DISCLAIMED.\n"
-         " IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,\n"
-         " INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES "
-         "(INCLUDING, BUT\n"
-         " NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS"
-         " OF USE,\n"
-         " DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND "
-         "ON ANY\n"
-         " THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR "
-         "TORT\n"
-         " (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE "
-         "USE OF\n"
-         " THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH "
-         "DAMAGE.\n");
-  exit(0);
+    if (!(e = strchr(p, ':'))) {
+      e = p + strlen(p);
+    }
+    dirlen = e - p;
+    if (!(full = malloc(dirlen + strlen(cmd) + 3))) {
+      return NULL;
+    }
+    if (dirlen) {
+      memcpy(full, p, dirlen);
+    } else {
+      full[dirlen++] = '.';
+    }
+    full[dirlen] = '/';
+    strcpy(full + dirlen + 1, cmd);
+    if (!access(full, X_OK)) {
+      return full;
+    }
+    free(full);
+    if (!*e) {
+      return NULL;
+    }
+  }
 }
 
+#ifdef IND_INJECT_LIB
 /**
- * just like strpbrk(), but haystack is not null-terminated
- *
- * @param  p:       string to search in
- * @param  chars:   characters to look for
- * @param  len:     length of string to search in
- *
- * @return   Pointer to first occurance of any of the characters, or NULL
- *           if not found.
+ * Will LD_PRELOAD take effect when executing path? True for dynamically
+ * linked ELF files (they have a PT_INTERP), and for #! scripts whose
+ * interpreter is one. Never for setuid/setgid files.
  */
-static char *
-mempbrk(const char *p, const char *chars, size_t len)
+static int
+preload_works(const char *path, int depth)
 {
+  unsigned char hdr[sizeof(Elf64_Ehdr)];
+  struct stat sb;
+  ssize_t n;
+  int ret = 0;
+  int fd;
   int c;
-  char *ret = NULL;
-  char *tmp;
 
-  for(c = strlen(chars); c; c--) {
-    tmp = memchr(p, chars[c-1], len);
-    if (tmp && (!ret || tmp < ret)) {
-      ret = tmp;
+  if (depth > 4 || stat(path, &sb) || (sb.st_mode & (S_ISUID|S_ISGID))) {
+    return 0;
+  }
+  if (0 > (fd = open(path, O_RDONLY))) {
+    return 0;
+  }
+  n = read(fd, hdr, sizeof(hdr));
+
+  if (n > 2 && hdr[0] == '#' && hdr[1] == '!') {
+    char interp[sizeof(hdr) + 1];
+    char *p;
+
+    memcpy(interp, hdr + 2, n - 2);
+    interp[n - 2] = 0;
+    p = interp + strspn(interp, " \t");
+    p[strcspn(p, " \t\n")] = 0;
+    ret = *p && preload_works(p, depth + 1);
+  } else if (n >= (ssize_t)sizeof(Elf32_Ehdr)
+             && !memcmp(hdr, ELFMAG, SELFMAG)) {
+    if (hdr[EI_CLASS] == ELFCLASS64 && n >= (ssize_t)sizeof(Elf64_Ehdr)) {
+      const Elf64_Ehdr *eh = (const Elf64_Ehdr *)hdr;
+      Elf64_Phdr ph;
+      for (c = 0; c < eh->e_phnum && !ret; c++) {
+        if (sizeof(ph) != pread(fd, &ph, sizeof(ph),
+                                eh->e_phoff + c * eh->e_phentsize)) {
+          break;
+        }
+        ret = ph.p_type == PT_INTERP;
+      }
+    } else if (hdr[EI_CLASS] == ELFCLASS32) {
+      const Elf32_Ehdr *eh = (const Elf32_Ehdr *)hdr;
+      Elf32_Phdr ph;
+      for (c = 0; c < eh->e_phnum && !ret; c++) {
+        if (sizeof(ph) != pread(fd, &ph, sizeof(ph),
+                                eh->e_phoff + c * eh->e_phentsize)) {
+          break;
+        }
+        ret = ph.p_type == PT_INTERP;
+      }
     }
   }
+  do_close(fd);
   return ret;
 }
 
 /**
- * In-place remove of all trailing newlines (be they CR or LF)
+ * --inject: exec the command directly with the annotation shim preloaded,
+ * so there is no ind process and no pipe in between.
  *
- * @param     str:    String to change (may be written to)
- * @return            New length of string
- */
-static size_t
-chomp(char *str)
-{
-  size_t len;
-  len = strlen(str);
-  while (len && strchr("\n\r",str[len-1])) {
-    str[len - 1] = 0;
-    len--;
-  }
-  return len;
-}
-
-/**
- * return malloc()ed and created string, caller calls free()
- * exit(1)s on failure (malloc() failed)
+ * Only returns if that's not possible, in which case the normal pty/pipe
+ * path should be used.
  *
- * @param   fmt:     format string, as specified in the manpage (%c is ctime
- *                   for example)
- * @param   bail:    Bail if format string is broken
- * @param   output:  place to store the output string pointer at
+ * @param   screen_mode  --screen was given
  */
 static void
-format(const char *infmt, char **output, int bail)
+try_inject(char **argv, const char *prefix, const char *postfix,
+           const char *eprefix, const char *epostfix, int screen_mode)
 {
-  if (!*infmt) {
-    *output = malloc(1);
-    assert(*output);
-    **output = 0;
-    return;
-  }
+  const struct sink *sk;
+  const struct sink *strip;
+  const char *lib;
+  const char *why = 0;
+  const char *old;
+  char *path = 0;
+  char *preload;
+  char ident[128];
+  struct stat so, se;
 
-  /* We need to inject a space as the first character in order to differentiate
-   * %p expanding to an empty string and an error, since strftime() sucks at
-   * error handling */
-  char fmt[strlen(infmt) + 2];
-  fmt[0] = ' ';
-  strcpy(&fmt[1], infmt);
+  if (!(lib = getenv("IND_INJECT_LIB"))) {
+    lib = IND_INJECT_LIB;
+  }
 
-  char *buf = 0;
-  size_t bufn = 2;
-  for (;;) {
-    time_t t;
-    char *newbuf;
-    size_t n;
+  for (sk = sinks; sk && sk->blocking; sk = sk->next);
+  for (strip = sinks; strip && !strip->strip; strip = strip->next);
 
-    if (!(newbuf = realloc(buf, bufn))) {
-      fprintf(stderr, "ind: Memory alloc of %zd bytes failed!\n", bufn);
-      exit(1);
+  if (json_output) {
+    why = "not supported with --json";
+  } else if (sk) {
+    why = sk->index_lines ? "not supported with --log"
+      : "not supported with --sink";
+  } else if (recorder) {
+    why = "not supported with --record";
+  } else if (screen_mode) {
+    why = "not supported with --screen";
+  } else if (strip) {
+    why = "not supported with --strip";
+  } else if (wrap) {
+    why = "not supported with --wrap";
+  } else if (tracer) {
+    why = "not supported with --trace-file";
+  } else if (metrics_file || 0 <= metrics_sock) {
+    why = "not supported with --metrics-file or --metrics-socket";
+  } else if (status_mode) {
+    why = "not supported with --status";
+  } else if (rusage_report) {
+    why = "not supported with --rusage";
+  } else if (perf_report_on) {
+    why = "not supported with --perf-counters";
+  } else if (gap_max) {
+    why = "not supported with --gap-report";
+  } else if (format_uses_vars(prefix) || format_uses_vars(postfix)
+             || format_uses_vars(eprefix) || format_uses_vars(epostfix)) {
+    /* nothing would sample the command */
+    why = "prefixes have %{...}";
+  } else if (format_kind(prefix) == TEMPLATE_DYNAMIC
+             || format_kind(postfix) == TEMPLATE_DYNAMIC
+             || format_kind(eprefix) == TEMPLATE_DYNAMIC
+             || format_kind(epostfix) == TEMPLATE_DYNAMIC) {
+    /* the shim can't expand them again without allocating */
+    why = "prefixes have strftime() directives";
+  } else if (getenv("IND_INJECT_IDENT")) {
+    why = "already running under an injected ind";
+  } else if (access(lib, R_OK)) {
+    why = "shim library not found";
+  } else if (fstat(STDOUT_FILENO, &so) || fstat(STDERR_FILENO, &se)) {
+    why = "stdout or stderr is closed";
+  } else if (!(path = find_in_path(argv[0]))) {
+    why = "command not found";
+  } else if (!preload_works(path, 0)) {
+    why = "command is not dynamically linked";
+  }
+  free(path);
+  if (why) {
+    if (verbose) {
+      fprintf(stderr, "%s: not injecting into %s: %s\n", argv0, argv[0], why);
     }
-    buf = newbuf;
+    return;
+  }
 
-    struct tm tm;
-    time(&t);
-    memcpy(&tm, localtime(&t), sizeof(tm));
-    if ((n = strftime(buf, bufn, fmt, &tm))) {
-      break;
+  if ((old = getenv("LD_PRELOAD")) && *old) {
+    if (!(preload = malloc(strlen(lib) + strlen(old) + 2))) {
+      fprintf(stderr, "%s: malloc() failed\n", argv0);
+      exit(1);
     }
+    sprintf(preload, "%s:%s", lib, old);
+  } else {
+    preload = (char *)lib;
+  }
+  snprintf(ident, sizeof(ident), "%llu:%llu %llu:%llu",
+           (unsigned long long)so.st_dev, (unsigned long long)so.st_ino,
+           (unsigned long long)se.st_dev, (unsigned long long)se.st_ino);
 
-    bufn *= 2;
-    if (bufn > max_indstr_length) {
-      /* Format expanded to too long a string, or is incorrectly formatted.
-       * in either case it's a user error or madness. */
-      if (bail) {
-        fprintf(stderr, "ind: Format string '%s' is broken.\n", fmt);
-        exit(1);
-      }
-
-      free(buf);
-      buf = strdup("ind fmt error");
-      if (!buf) {
-        fprintf(stderr, "ind: Memory alloc of a <20 bytes failed!\n");
-        exit(1);
-      }
-      break;
-    }
+  if (setenv("LD_PRELOAD", preload, 1)
+      || setenv("IND_INJECT_PREFIX", prefix, 1)
+      || setenv("IND_INJECT_POSTFIX", postfix, 1)
+      || setenv("IND_INJECT_EPREFIX", eprefix, 1)
+      || setenv("IND_INJECT_EPOSTFIX", epostfix, 1)
+      || setenv("IND_INJECT_IDENT", ident, 1)) {
+    fprintf(stderr, "%s: setenv(): %s\n", argv0, strerror(errno));
+    exit(1);
   }
-  memmove(buf, buf + 1, strlen(buf) + 1);
-  *output = buf;
+  if (verbose) {
+    fprintf(stderr, "%s: injecting %s into %s\n", argv0, lib, argv[0]);
+  }
+  execvp(argv[0], argv);
+  fprintf(stderr, "%s: %s: %s\n", argv0, argv[0], strerror(errno));
+  exit(1);
 }
+#endif
 
-/**
- * Main functionality function.
- * Read from fdin, if crossing a newline add magic.
- *
- * emptyline must point to 1 on first call, since the line is empty
- * before anything is written to it (makes sense).
- *
- * @param   fdin       source fd
- * @param   fdout      destination fd
- * @param   pre        prefix string
- * @param   prelen     prefix length (sent for efficiency)
- * @param   post       postfix string
- * @param   postlen    postfix length (sent for efficiency)
- * @param   emptyline  last this function was called, was it an empty line?
+/*
+ * Nested ind: "ind --nest ind ls" only needs one ind process. If its
+ * command is ind itself, the outer ind puts a datagram socket in the
+ * command's environment (IND_NEST). A nested ind that only has prefixes
+ * and postfixes to add sends them there, along with one end of a new
+ * socket pair, and waits for the go-ahead before running its command with
+ * the outer ind's stdin, stdout and stderr. The outer ind then does the
+ * nested ind's work itself, until the nested ind closes its end of the
+ * pair.
  *
- * @return        0 on success, !0 on "no more data will be readable ever"
+ * Everything written to the outer ind's pty then gets the nested ind's
+ * prefix, so this is only done when the nested ind is the command, not
+ * some process that may have others writing alongside it. The nested ind
+ * takes IND_NEST out of its own command's environment.
  */
-static int
-process(int fdin,int fdout,
-	const char *prefix,
-	const char *postfix, int *emptyline)
-{
-  int n;
-  char buf[128];
 
-  char *pre = 0;
-  char *post = 0;
+/* a nested ind whose work we do */
+struct nest_layer {
+  struct nest_layer *next;     /* the one it's nested in */
+  int fd;                      /* EOF when its command is done */
+  const char *prefix[NSTREAMS];
+  const char *postfix[NSTREAMS];
+  struct template pre[NSTREAMS];
+  struct template post[NSTREAMS];
+  int emptyline[NSTREAMS];
+  int cr[NSTREAMS];            /* last chunk ended in CR */
+  char *buf;                   /* output of the last nest_text() */
+  size_t buflen;
+  size_t bufsize;
+  char fmt[1];                 /* the formats, NUL separated */
+};
+
+static struct nest_layer *nest_layers = NULL;  /* innermost first */
+static int nest_fd = -1;                       /* for new nested inds */
+static int nest_opt = 0;                       /* --nest */
+
+/* longest registration message: four formats */
+#define NEST_MAX_MSG 4096
+
+/* when a nested ind comes or goes, read at most this many times to catch
+ * up, in case something else keeps writing */
+#define NEST_DRAIN_READS 1024
+
+/**
+ * Is cmd this very ind program?
+ */
+static int
+is_ind(const char *cmd)
+{
+  struct stat self, sb;
+  char *path;
+  int ret;
+
+  if (!(path = find_in_path(cmd))) {
+    return 0;
+  }
+  ret = !stat("/proc/self/exe", &self) && !stat(path, &sb)
+    && self.st_dev == sb.st_dev && self.st_ino == sb.st_ino;
+  free(path);
+  return ret;
+}
+
+/**
+ * --nest: let a nested ind join us, if the command is ind.
+ *
+ * @param   cmd   the command
+ * @param   fdo   the command's stdout
+ * @param   fde   the command's stderr
+ *
+ * @return  the socket for the command to inherit, -1 if none
+ */
+static int
+nest_listen(const char *cmd, int fdo, int fde)
+{
+  struct stat so, se;
+  int sv[2];
+  char env[128];
+
+  if (!nest_opt) {
+    return -1;
+  }
+  if (!is_ind(cmd)) {
+    if (verbose) {
+      fprintf(stderr, "%s: not accepting nested ind: %s is not ind\n",
+              argv0, cmd);
+    }
+    return -1;
+  }
+  if (fstat(fdo, &so) || fstat(fde, &se)
+      || socketpair(AF_UNIX, SOCK_DGRAM, 0, sv)) {
+    if (verbose) {
+      fprintf(stderr, "%s: not accepting nested ind: %s\n",
+              argv0, strerror(errno));
+    }
+    return -1;
+  }
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+  snprintf(env, sizeof(env), "%d %llu:%llu %llu:%llu", sv[1],
+           (unsigned long long)so.st_dev, (unsigned long long)so.st_ino,
+           (unsigned long long)se.st_dev, (unsigned long long)se.st_ino);
+  if (setenv("IND_NEST", env, 1)) {
+    fprintf(stderr, "%s: setenv(): %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+  nest_fd = sv[0];
+  return sv[1];
+}
+
+/**
+ * If running under another ind, with output going straight to it, hand it
+ * the prefixes and exec the command directly. IND_NEST is only for us, so
+ * it's taken away from the command either way, unless the command is ind
+ * too and --nest passes it on.
+ *
+ * Only returns if that's not possible, in which case this ind should do
+ * the work itself.
+ *
+ * @param   nestable  0 if we have options the outer ind can't take over
+ */
+static void
+try_nest(char **argv, const char *prefix, const char *postfix,
+         const char *eprefix, const char *epostfix, int nestable)
+{
+  char env[128];
+  const char *why = 0;
+  unsigned long long od, oi, ed, ei;
+  struct stat so, se;
+  char msg[NEST_MAX_MSG];
+  size_t len = 0;
+  int fd;
+  int sv[2];
+  char ack;
+  pid_t pid;
+  int status;
+
+  if (!getenv("IND_NEST")) {
+    return;
+  }
+  snprintf(env, sizeof(env), "%s", getenv("IND_NEST"));
+  unsetenv("IND_NEST");
+  if (5 != sscanf(env, "%d %llu:%llu %llu:%llu", &fd, &od, &oi, &ed, &ei)
+      || fd <= STDERR_FILENO || fstat(fd, &so) || !S_ISSOCK(so.st_mode)
+      || 0 > fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+    why = "IND_NEST is not for us";
+  } else if (!nestable) {
+    why = "options other than -p, -a, -P, -A and --nest";
+  } else if (fstat(STDOUT_FILENO, &so) || fstat(STDERR_FILENO, &se)) {
+    why = "stdout or stderr is closed";
+  } else if (so.st_dev != od || so.st_ino != oi
+             || se.st_dev != ed || se.st_ino != ei) {
+    why = "output is redirected";
+  } else if (strlen(prefix) + strlen(postfix) + strlen(eprefix)
+             + strlen(epostfix) + 4 > sizeof(msg)) {
+    why = "prefixes are too long";
+  } else if (format_uses_vars(prefix) || format_uses_vars(postfix)
+             || format_uses_vars(eprefix) || format_uses_vars(epostfix)) {
+    /* the outer ind would show its own command's */
+    why = "prefixes have %{...}";
+  } else if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    why = strerror(errno);
+  }
+
+  if (!why) {
+    struct msghdr mh;
+    struct iovec iov;
+    union {
+      struct cmsghdr cm;
+      char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct cmsghdr *cm;
+    const char *fmts[4];
+    int c;
+
+    fmts[0] = prefix;
+    fmts[1] = postfix;
+    fmts[2] = eprefix;
+    fmts[3] = epostfix;
+    for (c = 0; c < 4; c++) {
+      strcpy(msg + len, fmts[c]);
+      len += strlen(fmts[c]) + 1;
+    }
+
+    memset(&mh, 0, sizeof(mh));
+    memset(&ctl, 0, sizeof(ctl));
+    iov.iov_base = msg;
+    iov.iov_len = len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &sv[1], sizeof(int));
+
+    if (0 > sendmsg(fd, &mh, 0)) {
+      why = strerror(errno);
+    }
+    do_close(sv[1]);
+
+    /* once we have the go-ahead, the outer ind has read everything
+     * written before, and will add our prefixes to everything after */
+    if (!why && 1 != read(sv[0], &ack, 1)) {
+      why = "outer ind did not answer";
+    }
+    if (why) {
+      do_close(sv[0]);
+    }
+  }
+
+  if (why) {
+    if (verbose) {
+      fprintf(stderr, "%s: not nesting: %s\n", argv0, why);
+    }
+    return;
+  }
+
+  /* our output goes straight to the outer ind, so a nested ind in turn
+   * can join it too */
+  if (nest_opt && is_ind(argv[0])
+      && (setenv("IND_NEST", env, 1) || fcntl(fd, F_SETFD, 0))) {
+    fprintf(stderr, "%s: IND_NEST: %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+
+  /* Our parent (a shell, say) must not go on until the outer ind has read
+   * everything the command wrote and taken our prefixes away again, so
+   * we wait for the command and tell it when it's done. Other than that
+   * we're out of the way: no pty, no pipes, no copying. */
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+  switch ((pid = fork())) {
+  case 0:
+    execvp(argv[0], argv);
+    fprintf(stderr, "%s: %s: %s\n", argv0, argv[0], strerror(errno));
+    exit(1);
+  case -1:
+    fprintf(stderr, "%s: fork() failed: %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+  while (-1 == waitpid(pid, &status, 0)) {
+    if (errno != EINTR) {
+      fprintf(stderr, "%s: waitpid(%d): %s\n", argv0, pid, strerror(errno));
+      exit(1);
+    }
+  }
+  shutdown(sv[0], SHUT_WR);
+  if (1 != read(sv[0], &ack, 1)) {
+    /* outer ind is gone. Nothing left to wait for. */
+  }
+  exit(exit_code(status));
+}
+
+/**
+ * Tell a nested ind to go ahead.
+ */
+static void
+nest_ack(int fd)
+{
+#ifdef MSG_NOSIGNAL
+  if (1 != send(fd, "", 1, MSG_NOSIGNAL)) {
+#else
+  if (1 != write(fd, "", 1)) {
+#endif
+    /* it's gone already */
+  }
+}
+
+/**
+ * A nested ind wants to join. Only call this once everything written
+ * before has been read, since it starts getting its prefixes as soon as
+ * it's told to go ahead.
+ */
+static void
+nest_accept(void)
+{
+  char msg[NEST_MAX_MSG];
+  struct msghdr mh;
+  struct iovec iov;
+  union {
+    struct cmsghdr cm;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  struct cmsghdr *cm;
+  struct nest_layer *l;
+  const char *p;
+  ssize_t n;
+  int fd = -1;
+  int c;
+
+  memset(&mh, 0, sizeof(mh));
+  iov.iov_base = msg;
+  iov.iov_len = sizeof(msg);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctl.buf;
+  mh.msg_controllen = sizeof(ctl.buf);
+
+  if (0 >= (n = recvmsg(nest_fd, &mh, 0))) {
+    /* the command and all its children are gone */
+    if (!n || (errno != EINTR && errno != EAGAIN)) {
+      do_close(nest_fd);
+      nest_fd = -1;
+    }
+    return;
+  }
+  for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+      memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+    }
+  }
+  if (0 > fd) {
+    return;
+  }
+  if (!n || msg[n - 1]
+      || !(l = calloc(1, sizeof(struct nest_layer) + n))) {
+    do_close(fd);
+    return;
+  }
+  memcpy(l->fmt, msg, n);
+  l->fd = fd;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  for (p = l->fmt, c = 0; c < 4 && p < l->fmt + n; c++) {
+    const char **dst = (c & 1) ? l->postfix : l->prefix;
+    dst[c < 2 ? STREAM_STDOUT : STREAM_STDERR] = p;
+    p += strlen(p) + 1;
+  }
+  if (c < 4) {
+    do_close(fd);
+    free(l);
+    return;
+  }
+  for (c = 0; c < NSTREAMS; c++) {
+    template_init(&l->pre[c], l->prefix[c], 0);
+    template_init(&l->post[c], l->postfix[c], 0);
+  }
+  l->emptyline[STREAM_STDOUT] = l->emptyline[STREAM_STDERR] = 1;
+  l->next = nest_layers;
+  nest_layers = l;
+  if (verbose) {
+    fprintf(stderr, "%s: nested ind joined (prefix \"%s\")\n", argv0,
+            l->prefix[STREAM_STDOUT]);
+  }
+  nest_ack(fd);
+}
+
+/**
+ * A nested ind's command is done, and we have read everything it wrote.
+ */
+static void
+nest_remove(struct nest_layer *l)
+{
+  struct nest_layer **pp;
+  int c;
+
+  for (pp = &nest_layers; *pp != l; pp = &(*pp)->next);
+  *pp = l->next;
+  nest_ack(l->fd);
+  do_close(l->fd);
+  for (c = 0; c < NSTREAMS; c++) {
+    template_free(&l->pre[c]);
+    template_free(&l->post[c]);
+  }
+  free(l->buf);
+  free(l);
+}
+
+/**
+ * Handle nested inds joining (nest_fd readable) and finishing (their fd
+ * readable, at EOF).
+ */
+static void
+nest_update(fd_set *fds)
+{
+  struct nest_layer *l, *next;
+
+  for (l = nest_layers; l; l = next) {
+    char c;
+    next = l->next;
+    if (FD_ISSET(l->fd, fds) && 0 >= read(l->fd, &c, 1)) {
+      if (verbose) {
+        fprintf(stderr, "%s: nested ind done (prefix \"%s\")\n", argv0,
+                l->prefix[STREAM_STDOUT]);
+      }
+      nest_remove(l);
+    }
+  }
+  if (0 <= nest_fd && FD_ISSET(nest_fd, fds)) {
+    nest_accept();
+  }
+}
+
+/**
+ * @return  1 if select() found something for nest_update() to do
+ */
+static int
+nest_pending(fd_set *fds)
+{
+  const struct nest_layer *l;
+
+  if (0 <= nest_fd && FD_ISSET(nest_fd, fds)) {
+    return 1;
+  }
+  for (l = nest_layers; l; l = l->next) {
+    if (FD_ISSET(l->fd, fds)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Add to a layer's output.
+ */
+static void
+nest_put(struct nest_layer *l, const char *p, size_t n)
+{
+  if (l->buflen + n > l->bufsize) {
+    size_t newsize = l->bufsize ? l->bufsize : 256;
+    char *newbuf;
+
+    while (newsize < l->buflen + n) {
+      newsize *= 2;
+    }
+    if (!(newbuf = realloc(l->buf, newsize))) {
+      fprintf(stderr, "%s: Memory alloc of %zd bytes failed!\n",
+              argv0, newsize);
+      exit(1);
+    }
+    l->buf = newbuf;
+    l->bufsize = newsize;
+  }
+  memcpy(l->buf + l->buflen, p, n);
+  l->buflen += n;
+}
+
+/**
+ * Find the next CR or LF. cr and nl are where they were found last time
+ * (NULL if there are no more), so each byte of a chunk is looked at once,
+ * not once per line.
+ *
+ * @param   p, end   what's left of the chunk
+ * @param   cr, nl   next CR and LF at or after the last search
+ *
+ * @return  the first line break from p, or NULL
+ */
+static const char *
+next_break(const char *p, const char *end, const char **cr, const char **nl)
+{
+  if (*cr && *cr < p) {
+    *cr = memchr(p, '\r', end - p);
+  }
+  if (*nl && *nl < p) {
+    *nl = memchr(p, '\n', end - p);
+  }
+  if (!*cr || (*nl && *nl < *cr)) {
+    return *nl;
+  }
+  return *cr;
+}
+
+/**
+ * Do what the nested ind would have done to a chunk of output, leaving the
+ * result in l->buf.
+ */
+static void
+nest_text(struct nest_layer *l, int id, const char *p, size_t n)
+{
+  const struct template *pre = &l->pre[id];
+  const struct template *post = &l->post[id];
+  const char *cr, *nl;
+
+  template_update(&l->pre[id]);
+  template_update(&l->post[id]);
+  l->buflen = 0;
+  if (n && l->cr[id] && *p == '\n') {
+    /* the rest of a CRLF */
+    nest_put(l, p++, 1);
+    n--;
+  }
+  l->cr[id] = 0;
+  cr = memchr(p, '\r', n);
+  nl = memchr(p, '\n', n);
+  while (n) {
+    const char *q = next_break(p, p + n, &cr, &nl);
+    size_t len = q ? (size_t)(q - p) : n;
+
+    if (l->emptyline[id]) {
+      nest_put(l, pre->text, pre->len);
+      l->emptyline[id] = 0;
+    }
+    nest_put(l, p, len);
+    if (q) {
+      size_t term = 1 + (*q == '\r' && len + 1 < n && q[1] == '\n');
+      nest_put(l, post->text, post->len);
+      nest_put(l, q, term);
+      l->emptyline[id] = 1;
+      l->cr[id] = *q == '\r' && len + 1 == n;
+      len += term;
+    }
+    p += len;
+    n -= len;
+  }
+}
+
+/**
+ * Append the stdout prefixes of l and the layers it's nested in,
+ * outermost first.
+ */
+static void
+nest_cat_prefixes(char *dst, const struct nest_layer *l)
+{
+  if (l) {
+    nest_cat_prefixes(dst, l->next);
+    strcat(dst, l->prefix[STREAM_STDOUT]);
+  }
+}
+
+/**
+ * The prefix and postfix as seen by the command, for its window size:
+ * ours, plus those of all the nested inds.
+ *
+ * @param   pre, post   our prefix and postfix, replaced with malloc()ed
+ *                      composed ones
+ */
+static void
+nest_compose(const char **pre, const char **post)
+{
+  const struct nest_layer *l;
+  size_t prelen = strlen(*pre) + 1;
+  size_t postlen = strlen(*post) + 1;
+  char *p, *q;
+
+  for (l = nest_layers; l; l = l->next) {
+    prelen += strlen(l->prefix[STREAM_STDOUT]);
+    postlen += strlen(l->postfix[STREAM_STDOUT]);
+  }
+  if (!(p = malloc(prelen)) || !(q = malloc(postlen))) {
+    fprintf(stderr, "%s: malloc() failed\n", argv0);
+    exit(1);
+  }
+  strcpy(p, *pre);
+  nest_cat_prefixes(p, nest_layers);
+  *q = 0;
+  for (l = nest_layers; l; l = l->next) {
+    strcat(q, l->postfix[STREAM_STDOUT]);
+  }
+  strcat(q, *post);
+  *pre = p;
+  *post = q;
+}
+
+/**
+ * 
+ *
+ * 
+ */
+static struct termios orig_stdin_tio;
+static int orig_stdin_tio_ok = 0;
+static void
+reset_stdin_terminal()
+{
+  if (!orig_stdin_tio_ok) {
+    return;
+  }
+
+  /* reset terminal settings */
+  if (tcsetattr(STDIN_FILENO, TCSADRAIN, &orig_stdin_tio)) {
+    fprintf(stderr,
+	    "%s: Unable to restore terminal settings:"
+	    "%s: tcsetattr(STDIN_FILENO, TCSADRAIN, orig): %s",
+	    argv0, argv0, strerror(errno));
+  }
+}
+
+/**
+ * Print usage information and exit
+ *
+ * @param  err: value sent to exit()
+ */
+static void NORETURN
+usage(int err)
+{
+  
+  printf("ind %s, by Thomas Habets <thomas@habets.se>\n"
+	 "usage: %s [ -h ] [ -p <fmt> ] [ -a <fmt> ] [ -P <fmt> ] "
+	 "[ -A <fmt> ] [ --json ] [ --inject ] [ --nest ] [ --screen ]\n"
+	 "          [ --strip stdout|stderr|both ] [ --wrap [ --wrap-marker <fmt> ] ]\n"
+	 "          [ --line-atomic [ --line-hold <ms> ] [ --line-max <bytes> ] ]\n"
+	 "          [ --sink <path> | --syslog <socket> [ sink options ] ] ...\n"
+	 "          <command> <args> ...\n"
+	 "       %s --replay <file> [ --speed <n> ] [ options ]\n"
+	 "       %s --seek-time <time> <log>\n"
+	 "\t-a          Postfix stdout (default: \"\")\n"
+	 "\t-A          Postfix stderr (default: \"\")\n"
+	 "\t--copying   Show 3-clause BSD license\n"
+	 "\t-h, --help  Show this help text\n"
+	 "\t--inject    Annotate inside the command (LD_PRELOAD) if possible\n"
+	 "\t--json      Output JSON Lines records instead of annotated text\n"
+	 "\t--line-atomic  Write each line in one write(), hold partial lines\n"
+	 "\t--line-hold <ms>    Max time to hold a partial line (default: 100)\n"
+	 "\t--line-max <bytes>  Max partial line to hold (default: 65536)\n"
+	 "\t--nest      If the command is ind, do its work in this process\n"
+	 "\t-p          Prefix stdout (default: \"  \")\n"
+	 "\t-P          Prefix stderr (default: \">>\") \n"
+	 "\t--record <file>  Append a timed recording of the output to file\n"
+	 "\t--record-stdin   Record stdin too\n"
+	 "\t--replay <file>  Show a recording instead of running a command\n"
+	 "\t--screen    Run fullscreen programs in a screen next to the prefix\n"
+	 "\t--strip stdout|stderr|both  Remove escape codes (colors etc)\n"
+	 "\t--wrap      Wrap long lines at the terminal width, with the prefix\n"
+	 "\t--wrap-marker <fmt>  Start wrapped lines with this instead\n"
+	 "\t--priority stdout|stderr|none  Read this first (default: stderr)\n"
+	 "\t--read-budget <n>  Reads per stream before the other's turn (16)\n"
+	 "\t--drain-timeout <ms>  Max time to wait for output once the command\n"
+	 "\t                      has exited (default: until EOF)\n"
+	 "\t--trace-file <file>  Write a Chrome/Perfetto trace of the main loop\n"
+	 "\t--metrics-file <file>     Keep Prometheus metrics in file\n"
+	 "\t--metrics-interval <ms>   How often to update it (default: 10000)\n"
+	 "\t--metrics-socket <path>   Serve the metrics on a Unix socket\n"
+	 "\t--status    Show throughput on the bottom row, or on stderr\n"
+	 "\t--rusage    Report the command's resource usage, and ind's, at exit\n"
+	 "\t--perf-counters  Report the command's CPU counters (Linux) at exit\n"
+	 "\t--gap-report <n>  Report the n longest silences between lines\n"
+	 "\t--speed <n>      Replay speed, 0 for no delays (default: 1)\n"
+	 "\t--log <path>   Like --sink, plus a time index in <path>.idx\n"
+	 "\t--index-lines <n>, --index-ms <ms>  Index interval (1000, 1000)\n"
+	 "\t--seek-time <time>  Show a --log from time (HH:MM[:SS], @<epoch>, ...)\n"
+	 "\t--sink <path>  Also write output to file or FIFO (repeatable)\n"
+	 "\t--syslog <socket>  Also send RFC 5424 records to e.g. /dev/log\n"
+	 "\tSink options, applying to the preceding --sink or --syslog:\n"
+	 "\t--sink-buffer <bytes>        Queue limit (default: 1048576)\n"
+	 "\t--sink-json                  Write JSON Lines records\n"
+	 "\t--sink-policy block|drop|disconnect\n"
+	 "\t                             When behind (default: block)\n"
+	 "\t--sink-prefix, --sink-postfix, --sink-eprefix, --sink-epostfix <fmt>\n"
+	 "\t                             Like -p, -a, -P, -A (default: same)\n"
+	 "\t--sink-streams stdout|stderr|both  (default: both)\n"
+	 "\t--sink-strip stdout|stderr|both    Remove escape codes (colors etc)\n"
+	 "\t-v          Verbose (repeat -v to increase verbosity)\n"
+	 "\t--version   Show version\n"
+	 "Format is strftime()-formatted text, plus the command's %%{rss},\n"
+	 "%%{cpu} (percent) and %%{threads}, sampled every 250 ms. Examples:\n"
+         "\t%s -p 'Hello world | '  echo foo\n"
+         "\t => Hello world | foo\n"
+         "\t%s -p '%%F %%T %%Z | '  echo foo\n"
+         "\t => 2011-08-01 16:08:36 BST | foo\n"
+	 , version, argv0, argv0, argv0, argv0, argv0);
+  exit(err);
+}
+
+/**
+ *
+ */
+static void NORETURN
+printVersion()
+{
+  printf("ind %s\n", version);
+  printf("Copyright (C) 2005-2009 Thomas Habets <thomas@habets.se>\n"
+         "License 3-clause BSD. Run with --copying to see the whole license.\n"
+         "This is free software: you are free to change and "
+         "redistribute it.\n"
+         "There is NO WARRANTY, to the extent permitted by law.\n");
+  exit(0);
+}
+
+/**
+ *
+ */
+static void NORETURN
+printLicense()
+{
+  printf("ind %s\n", version);
+  printf("(BSD license without advertising clause below)\n"
+         "\n"
+         " Copyright (c) 2005-2009 Thomas Habets <thomas@habets.se>. All rights reserved.\n"
+         "\n"
+         " Redistribution and use in source and binary forms, with or "
+         "without\n"
+         " modification, are permitted provided that the following "
+         "conditions\n"
+         " are met:\n"
+         " 1. Redistributions of source code must retain the above copyright\n"
+         "    notice, this list of conditions and the following disclaimer.\n"
+         " 2. Redistributions in binary form must reproduce the above "
+         "copyright\n"
+         "    notice, this list of conditions and the following disclaimer in"
+         " the\n"
+         "    documentation and/or other materials provided with the "
+         "distribution.\n"
+         " 3. The name of the author may not be used to endorse or promote"
+         " products\n"
+         "    derived from this software without specific prior written "
+         "permission.\n"
+         "\n"
+         " THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS "
+         "OR\n"
+         " IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED "
+         "WARRANTIES\n"
+         " OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE "
+         "DISCLAIMED.\n"
+         " IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,\n"
+         " INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES "
+         "(INCLUDING, BUT\n"
+         " NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS"
+         " OF USE,\n"
+         " DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND "
+         "ON ANY\n"
+         " THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR "
+         "TORT\n"
+         " (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE "
+         "USE OF\n"
+         " THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH "
+         "DAMAGE.\n");
+  exit(0);
+}
+
+/**
+ * In-place remove of all trailing newlines (be they CR or LF)
+ *
+ * @param     str:    String to change (may be written to)
+ * @return            New length of string
+ */
+static size_t
+chomp(char *str)
+{
+  size_t len;
+  len = strlen(str);
+  while (len && strchr("\n\r",str[len-1])) {
+    str[len - 1] = 0;
+    len--;
+  }
+  return len;
+}
+
+/* --strip: where stripped text collects. It's never longer than the input. */
+static char *strip_buf = NULL;
+static size_t strip_len = 0;
+static size_t strip_size = 0;
+
+/**
+ * Parser callback for --strip: text is kept.
+ */
+static void
+strip_print(void *ctx, const char *p, size_t n)
+{
+  ctx = ctx; /* hide warning */
+  memcpy(strip_buf + strip_len, p, n);
+  strip_len += n;
+}
+
+/**
+ * Parser callback for --strip: so are control characters (newlines, tabs).
+ */
+static void
+strip_execute(void *ctx, int c)
+{
+  ctx = ctx; /* hide warning */
+  strip_buf[strip_len++] = c;
+}
+
+/* escape sequences, being the point, have no callbacks */
+static const struct vt_callbacks strip_callbacks = {
+  strip_print,
+  strip_execute,
+  NULL,
+  NULL,
+};
+
+/**
+ * Remove CSI, OSC and other escape sequences from a chunk of one of the
+ * child's streams. The parser state is kept per sink and stream, so
+ * sequences split between reads are removed too.
+ *
+ * @param   sk    sink
+ * @param   id    stream
+ * @param   buf   data. Changed to point to the stripped data.
+ * @param   n     length of data
+ *
+ * @return  length of the stripped data
+ */
+static size_t
+sink_strip(struct sink *sk, int id, const char **buf, size_t n)
+{
+  struct vt_parser *vt = &sk->stripper[id];
+
+  /* usually there's nothing to strip, so don't copy anything */
+  if (vt->state == VT_GROUND && !memchr(*buf, '\033', n)) {
+    return n;
+  }
+
+  if (n > strip_size) {
+    char *newbuf;
+    if (!(newbuf = realloc(strip_buf, n))) {
+      fprintf(stderr, "%s: Memory alloc of %zd bytes failed!\n", argv0, n);
+      exit(1);
+    }
+    strip_buf = newbuf;
+    strip_size = n;
+  }
+  strip_len = 0;
+  vt_feed(vt, *buf, n);
+  *buf = strip_buf;
+  return strip_len;
+}
+
+static void wrap_print(void *ctx, const char *p, size_t n);
+static void wrap_execute(void *ctx, int c);
+static const struct vt_callbacks wrap_callbacks = {
+  wrap_print,
+  wrap_execute,
+  NULL,
+  NULL,
+};
+
+/**
+ * Allocate a sink and add it to the end of the sink list.
+ *
+ * @param   name:     for messages
+ * @param   fd:       fd to write to
+ * @param   streams:  bitmask of streams to write to it
+ * @param   blocking: fd is shared with other processes (e.g. our stdout), so
+ *                    it's written with blocking writes
+ */
+static struct sink *
+sink_new(const char *name, int fd, unsigned streams, int blocking)
+{
+  struct sink *sk;
+  struct sink **pp;
+  int c;
+
+  if (!(sk = calloc(1, sizeof(struct sink)))) {
+    fprintf(stderr, "%s: Memory alloc of a sink failed!\n", argv0);
+    exit(1);
+  }
+  sk->name = name;
+  sk->fd = fd;
+  sk->blocking = blocking;
+  sk->streams = streams;
+  sk->policy = SINK_BLOCK;
+  sk->bufmax = 1048576;
+  sk->idxfd = -1;
+  for (c = 0; c < NSTREAMS; c++) {
+    sk->emptyline[c] = 1;
+    vt_init(&sk->stripper[c], &strip_callbacks, NULL);
+    vt_init(&sk->wrapper[c].vt, &wrap_callbacks, &sk->wrapper[c]);
+    sk->wrapper[c].sk = sk;
+  }
+
+  for (pp = &sinks; *pp; pp = &(*pp)->next);
+  *pp = sk;
+  return sk;
+}
+
+/**
+ * Stop writing to a sink for good.
+ */
+static void
+sink_disconnect(struct sink *sk, const char *why)
+{
+  /* our own stdout/stderr going away is nothing new */
+  if (!sk->blocking || verbose) {
+    fprintf(stderr, "%s: %s: %s, disconnecting\n", argv0, sk->name, why);
+  }
+  if (!sk->blocking) {
+    do_close(sk->fd);
+  }
+  sk->fd = -1;
+  sk->bufoff = sk->buflen = sk->complete = 0;
+  sk->rechead = sk->nrec = 0;
+}
+
+/**
+ * Make room for n more bytes in the sink's buffer.
+ *
+ * @return  pointer to where they go
+ */
+static char *
+sink_reserve(struct sink *sk, size_t n)
+{
+  if (sk->bufoff && sk->bufoff + sk->buflen + n > sk->bufsize) {
+    memmove(sk->buf, sk->buf + sk->bufoff, sk->buflen);
+    sk->bufoff = 0;
+  }
+  if (sk->buflen + n > sk->bufsize) {
+    size_t newsize = sk->bufsize ? sk->bufsize : 4096;
+    char *newbuf;
+
+    while (newsize < sk->buflen + n) {
+      newsize *= 2;
+    }
+    if (!(newbuf = realloc(sk->buf, newsize))) {
+      fprintf(stderr, "%s: Memory alloc of %zd bytes failed!\n",
+              argv0, newsize);
+      exit(1);
+    }
+    sk->buf = newbuf;
+    sk->bufsize = newsize;
+  }
+  return sk->buf + sk->bufoff + sk->buflen;
+}
+
+/**
+ * Append to the sink's buffer.
+ */
+static void
+sink_put(struct sink *sk, const char *p, size_t n)
+{
+  memcpy(sink_reserve(sk, n), p, n);
+  sk->buflen += n;
+}
+
+/**
+ * The last sk->buflen - (what's already queued) bytes are a complete
+ * datagram.
+ */
+static void
+sink_end_record(struct sink *sk, size_t len)
+{
+  if (sk->rechead && sk->rechead + sk->nrec == sk->recsize) {
+    memmove(sk->rec, sk->rec + sk->rechead, sk->nrec * sizeof(size_t));
+    sk->rechead = 0;
+  }
+  if (sk->rechead + sk->nrec == sk->recsize) {
+    size_t newsize = sk->recsize ? sk->recsize * 2 : SYSLOG_BATCH;
+    size_t *newrec;
+
+    if (!(newrec = realloc(sk->rec, newsize * sizeof(size_t)))) {
+      fprintf(stderr, "%s: Memory alloc of %zd records failed!\n",
+              argv0, newsize);
+      exit(1);
+    }
+    sk->rec = newrec;
+    sk->recsize = newsize;
+  }
+  sk->rec[sk->rechead + sk->nrec++] = len;
+}
+
+/**
+ * sink_flush() for datagram sinks. Up to SYSLOG_BATCH records go out
+ * per system call.
+ *
+ * @return  0 on success (even if not everything was sent), -1 if the
+ *          sink is (now) disconnected
+ */
+static int
+sink_flush_dgram(struct sink *sk)
+{
+  while (sk->nrec) {
+    size_t cnt = sk->nrec < SYSLOG_BATCH ? sk->nrec : SYSLOG_BATCH;
+    int n;
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[SYSLOG_BATCH];
+    struct iovec iov[SYSLOG_BATCH];
+    size_t off = sk->bufoff;
+    size_t c;
+
+    memset(msgs, 0, cnt * sizeof(struct mmsghdr));
+    for (c = 0; c < cnt; c++) {
+      iov[c].iov_base = sk->buf + off;
+      iov[c].iov_len = sk->rec[sk->rechead + c];
+      off += iov[c].iov_len;
+      msgs[c].msg_hdr.msg_iov = &iov[c];
+      msgs[c].msg_hdr.msg_iovlen = 1;
+    }
+    do {
+      n = sendmmsg(sk->fd, msgs, cnt, 0);
+    } while ((-1 == n) && (errno == EINTR));
+#else
+    cnt = 1;
+    do {
+      n = send(sk->fd, sk->buf + sk->bufoff, sk->rec[sk->rechead], 0);
+    } while ((-1 == n) && (errno == EINTR));
+    if (0 < n) {
+      n = 1;
+    }
+#endif
+    if (0 > n) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        break;
+      }
+      sink_disconnect(sk, strerror(errno));
+      return -1;
+    }
+    for (; n; n--) {
+      sk->written += sk->rec[sk->rechead];
+      sk->bufoff += sk->rec[sk->rechead];
+      sk->buflen -= sk->rec[sk->rechead];
+      sk->rechead++;
+      sk->nrec--;
+    }
+  }
+  if (!sk->nrec) {
+    sk->rechead = sk->bufoff = 0;
+  }
+  return 0;
+}
+
+/**
+ * --line-atomic: how much to write next. As many whole lines as fit in
+ * PIPE_BUF, so that the write can't be interleaved with anyone else's,
+ * or a single line if it's longer than that.
+ */
+static size_t
+atomic_chunk(const struct sink *sk)
+{
+  const char *p = sk->buf + sk->bufoff;
+  size_t len = sk->complete < PIPE_BUF ? sk->complete : PIPE_BUF;
+  const char *q;
+
+  while (len && p[len - 1] != '\n' && p[len - 1] != '\r') {
+    len--;
+  }
+  if (!len && sk->complete) {
+    q = mempbrk(p, "\r\n", sk->complete);
+    len = q ? (size_t)(q - p + 1) : sk->complete;
+  }
+  return len;
+}
+
+/**
+ * --line-atomic: let the held partial line go, e.g. because it's been
+ * held too long.
+ */
+static void
+sink_release(struct sink *sk)
+{
+  sk->complete = sk->buflen;
+}
+
+/**
+ * --status on stderr: take the status line away, so output can go there.
+ */
+static void
+status_hide(void)
+{
+  if (0 > safe_write(STDERR_FILENO, "\r\033[K", 4)) {
+    /* nothing to be done */
+  }
+  status_shown = 0;
+}
+
+/**
+ * Write as much of the buffer as the sink will take right now. Blocking
+ * sinks take all of it. With --line-atomic, a partial line at the end is
+ * held back.
+ *
+ * @return  0 on success (even if not everything was written), -1 if the
+ *          sink is (now) disconnected
+ */
+static int
+sink_flush(struct sink *sk)
+{
+  ssize_t n;
+
+  if (sk->fd < 0) {
+    return -1;
+  }
+  if (status_shown && sk->buflen
+      && (sk == status_share[0] || sk == status_share[1])) {
+    status_hide();
+  }
+  if (sk->syslog) {
+    int ret;
+    long long t0 = tracer ? trace_now() : 0;
+
+    ret = sink_flush_dgram(sk);
+    if (tracer) {
+      trace_add(tracer, "write", sk->fd, t0);
+    }
+    return ret;
+  }
+  while (sk->buflen) {
+    size_t len = sk->buflen;
+    struct timespec start;
+    long long t0 = tracer ? trace_now() : 0;
+
+    if (line_atomic && !(len = atomic_chunk(sk))) {
+      break;
+    }
+    if (IND_PROBE_ENABLED(write) || (extra_stats && sk->blocking)) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    if (sk->blocking) {
+      n = safe_write(sk->fd, sk->buf + sk->bufoff, len);
+    } else {
+      do {
+        n = write(sk->fd, sk->buf + sk->bufoff, len);
+      } while ((-1 == n) && (errno == EINTR));
+    }
+    if (tracer) {
+      trace_add(tracer, "write", sk->fd, t0);
+    }
+    if (IND_PROBE_ENABLED(write) || (extra_stats && sk->blocking)) {
+      struct timespec end;
+      long long ns;
+
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      ns = (end.tv_sec - start.tv_sec) * 1000000000LL
+        + (end.tv_nsec - start.tv_nsec);
+      IND_PROBE3(write, sk->fd, n, ns);
+      if (sk->blocking) {
+        sk->blocked_ns += ns;
+      }
+    }
+    if (0 > n) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      sink_disconnect(sk, strerror(errno));
+      return -1;
+    }
+    if (!n) {
+      sink_disconnect(sk, "write() returned 0");
+      return -1;
+    }
+    sk->bufoff += n;
+    sk->buflen -= n;
+    sk->written += n;
+    sk->complete -= (size_t)n < sk->complete ? (size_t)n : sk->complete;
+  }
+  if (!sk->buflen) {
+    sk->bufoff = 0;
+  }
+  if (sk->buflen == sk->complete) {
+    sk->holding = 0;
+  }
+  return 0;
+}
+
+/**
+ * Does the sink have anything it could write right now?
+ */
+static int
+sink_pending(const struct sink *sk)
+{
+  if (sk->syslog) {
+    return sk->nrec > 0;
+  }
+  return line_atomic ? sk->complete > 0 : sk->buflen > 0;
+}
+
+/**
+ * Wait until the sink has no more than max bytes buffered, or nothing
+ * more it could write. A partial line held back by --line-atomic stays;
+ * the hold timer and --line-max let it go.
+ *
+ * @return  0 on success, -1 if the sink got disconnected
+ */
+static int
+sink_drain(struct sink *sk, size_t max)
+{
+  while (sk->buflen > max && sink_pending(sk)) {
+    fd_set wfds;
+    struct timespec start;
+
+    if (sink_flush(sk)) {
+      return -1;
+    }
+    if (sk->buflen <= max || !sink_pending(sk)) {
+      break;
+    }
+    FD_ZERO(&wfds);
+    FD_SET(sk->fd, &wfds);
+    if (extra_stats) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    if (0 > select(sk->fd + 1, NULL, &wfds, NULL, NULL) && errno != EINTR) {
+      sink_disconnect(sk, strerror(errno));
+      return -1;
+    }
+    if (extra_stats) {
+      struct timespec end;
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      sk->blocked_ns += (end.tv_sec - start.tv_sec) * 1000000000LL
+        + (end.tv_nsec - start.tv_nsec);
+    }
+  }
+  return 0;
+}
+
+/**
+ * A new line is about to be written to the sink. If the sink has fallen
+ * behind, apply its policy.
+ *
+ * @return  0 if the line should be written, -1 if not
+ */
+static int
+sink_begin_line(struct sink *sk, int id)
+{
+  if (sk->buflen < sk->bufmax) {
+    return 0;
+  }
+  switch (sk->policy) {
+  case SINK_BLOCK:
+    return sink_drain(sk, sk->bufmax / 2);
+  case SINK_DROP:
+    sk->dropping[id] = DROP_LINE;
+    sk->dropped++;
+    if (verbose > 1) {
+      fprintf(stderr, "%s: %s: dropping line\n", argv0, sk->name);
+    }
+    return -1;
+  case SINK_DISCONNECT:
+    sink_disconnect(sk, "fell behind");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * The current line keeps growing while the sink is behind. Let a started
+ * line overshoot bufmax some, but not forever.
+ */
+static void
+sink_check_overrun(struct sink *sk, int id)
+{
+  if (sk->buflen < 2 * sk->bufmax) {
+    return;
+  }
+  switch (sk->policy) {
+  case SINK_BLOCK:
+    sink_drain(sk, sk->bufmax / 2);
+    break;
+  case SINK_DROP:
+    sk->dropping[id] = DROP_REST;
+    sk->dropped++;
+    break;
+  case SINK_DISCONNECT:
+    sink_disconnect(sk, "fell behind");
+    break;
+  }
+}
+
+/**
+ * A line is about to start in the sink. For --log, add an index entry
+ * if it's been long enough since the last one.
+ */
+static void
+sink_index(struct sink *sk)
+{
+  struct idx_entry e;
+  struct timespec now;
+
+  if (sk->idxfd < 0) {
+    return;
+  }
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (sk->idx_time.tv_sec
+      && sk->lines + 1 - sk->idx_line < sk->index_lines
+      && ((now.tv_sec - sk->idx_time.tv_sec) * 1000
+          + (now.tv_nsec - sk->idx_time.tv_nsec) / 1000000
+          < (long long)sk->index_ms)) {
+    return;
+  }
+  e.time_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  e.offset = sk->base + sk->written + sk->buflen;
+  e.line = sk->lines + 1;
+  if (idx_add(sk->idxfd, &e)) {
+    fprintf(stderr, "%s: %s.idx: %s, indexing stopped\n",
+            argv0, sk->name, strerror(errno));
+    do_close(sk->idxfd);
+    sk->idxfd = -1;
+    return;
+  }
+  sk->idx_line = e.line;
+  sk->idx_time = now;
+}
+
+/**
+ * Is it worth a system call to write out what's queued for the sink?
+ */
+static int
+sink_batch_full(const struct sink *sk)
+{
+  if (sk->syslog) {
+    return sk->nrec >= SYSLOG_BATCH;
+  }
+  return sk->buflen >= SINK_BATCH_BYTES || sk->buflen >= sk->bufmax / 2;
+}
+
+/**
+ * --wrap: end the terminal line at "at", and start a continuation line.
+ */
+static void
+wrap_break(struct wrapper *w, const char *at)
+{
+  sink_put(w->sk, w->done, at - w->done);
+  sink_put(w->sk, w->post, strlen(w->post));
+  sink_put(w->sk, "\n", 1);
+  sink_put(w->sk, w->cont, strlen(w->cont));
+  w->done = at;
+  w->col = w->contcols;
+}
+
+/**
+ * --wrap: a character of the given width was just decoded, ending at
+ * "after". Break the line before it if it doesn't fit.
+ */
+static void
+wrap_char(struct wrapper *w, int width, const char *after)
+{
+  if (w->col + width > w->limit) {
+    if (!w->lead) {
+      /* started in an earlier chunk, which is already written. Break
+       * after it instead. */
+      wrap_break(w, after);
+      return;
+    }
+    wrap_break(w, w->lead);
+  }
+  w->col += width;
+}
+
+/**
+ * Parser callback for --wrap: measure printable text. The text itself is
+ * written as it was, with line breaks inserted.
+ */
+static void
+wrap_print(void *ctx, const char *buf, size_t n)
+{
+  struct wrapper *w = ctx;
+  const unsigned char *p = (const unsigned char*)buf;
+  const unsigned char *end = p + n;
+
+  while (p < end) {
+    unsigned char b;
+
+    /* fast path: ASCII is one column per byte */
+    if (!w->uneed && *p < 0x80) {
+      const unsigned char *q = p;
+      size_t room;
+
+      while (q < end && *q < 0x80) {
+        q++;
+      }
+      while ((size_t)(q - p)
+             > (room = w->col < w->limit ? w->limit - w->col : 0)) {
+        p += room;
+        wrap_break(w, (const char*)p);
+      }
+      w->col += q - p;
+      p = q;
+      continue;
+    }
+
+    b = *p++;
+    if (w->uneed) {
+      if ((b & 0xc0) == 0x80) {
+        w->ucs = (w->ucs << 6) | (b & 0x3f);
+        if (!--w->uneed) {
+          wrap_char(w, char_width(w->ucs), (const char*)p);
+        }
+        continue;
+      }
+      /* cut short. Whatever the terminal shows for it, don't count it. */
+      w->uneed = 0;
+    }
+    w->lead = (const char*)p - 1;
+    if (b < 0x80) {
+      wrap_char(w, 1, (const char*)p);
+    } else if ((b & 0xe0) == 0xc0) {
+      w->ucs = b & 0x1f;
+      w->uneed = 1;
+    } else if ((b & 0xf0) == 0xe0) {
+      w->ucs = b & 0x0f;
+      w->uneed = 2;
+    } else if ((b & 0xf8) == 0xf0) {
+      w->ucs = b & 0x07;
+      w->uneed = 3;
+    } else {
+      wrap_char(w, 1, (const char*)p);
+    }
+  }
+}
+
+/**
+ * Parser callback for --wrap: control characters that move the cursor.
+ */
+static void
+wrap_execute(void *ctx, int c)
+{
+  struct wrapper *w = ctx;
+
+  if (c == '\t') {
+    /* the terminal stops tabs at the margin */
+    w->col = (w->col + 8) & ~7;
+    if (w->col > w->limit) {
+      w->col = w->limit;
+    }
+  } else if (c == '\b' && w->col > 0) {
+    w->col--;
+  }
+}
+
+/**
+ * --wrap: how many columns a prefix, postfix or marker takes on the
+ * terminal, measured the way the line itself is: escape sequences take
+ * none, and UTF-8 characters take their display width.
+ */
+static int
+text_width(const char *s)
+{
+  struct wrapper m;
+
+  memset(&m, 0, sizeof(m));
+  m.limit = INT_MAX;
+  vt_init(&m.vt, &wrap_callbacks, &m);
+  vt_feed(&m.vt, s, strlen(s));
+  return m.col;
+}
+
+/**
+ * Write part of a line to a terminal sink, breaking it where the
+ * terminal would have wrapped it, and starting each continuation line
+ * with the prefix (or --wrap-marker).
+ *
+ * @param   sk    sink to write to
+ * @param   id    stream the data came from
+ * @param   p     data, with no line breaks
+ * @param   n     length of data
+ * @param   pre   prefix of this line
+ * @param   post  postfix
+ */
+static void
+wrap_put(struct sink *sk, int id, const char *p, size_t n,
+         const char *pre, const char *post)
+{
+  struct wrapper *w = &sk->wrapper[id];
+
+  if (wrap_marker) {
+    template_update(&wrap_template);
+  }
+  w->cont = wrap_marker ? wrap_template.text : pre;
+  w->contcols = text_width(w->cont);
+  w->post = post;
+  w->limit = sk->cols - text_width(post);
+
+  /* the terminal is too narrow for this to help */
+  if (w->limit <= w->contcols) {
+    sink_put(sk, p, n);
+  } else {
+    w->lead = NULL;
+    w->done = p;
+    vt_feed(&w->vt, p, n);
+    sink_put(sk, w->done, p + n - w->done);
+  }
+}
+
+/* for code meant to be stamped out with constant arguments */
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/**
+ * Text output: add prefix and postfix to every line. Inlined into the
+ * sink_text_*() below with has_pre and has_post constant, so an empty
+ * prefix or postfix costs nothing per line.
+ *
+ * @param   sk:        sink to write to
+ * @param   id:        stream the data came from
+ * @param   p, n:      data
+ * @param   has_pre:   sk->pre[id] may be non-empty
+ * @param   has_post:  sk->post[id] may be non-empty
+ */
+static ALWAYS_INLINE void
+sink_text_lines(struct sink *sk, int id, const char *p, size_t n,
+                const int has_pre, const int has_post)
+{
+  const char *pre = sk->pre[id].text;
+  const char *post = sk->post[id].text;
+  const size_t prelen = sk->pre[id].len;
+  const size_t postlen = sk->post[id].len;
+  const char *cr, *nl;
+
+  /* a CRLF (from a pty's ONLCR) ends one line, not two, even when it's
+   * split between reads */
+  if (n && sk->cr[id] && *p == '\n') {
+    if (sk->cr[id] > 0) {
+      sink_put(sk, p, 1);
+      sk->lines++;
+      sk->complete = sk->buflen;
+    }
+    p++;
+    n--;
+  }
+  sk->cr[id] = 0;
+
+  cr = memchr(p, '\r', n);
+  nl = memchr(p, '\n', n);
+  while (n && sk->fd >= 0) {
+    const char *q = next_break(p, p + n, &cr, &nl);
+    size_t len = q ? (size_t)(q - p) : n;
+    size_t term = 0;
+
+    if (q) {
+      term = 1 + (*q == '\r' && len + 1 < n && q[1] == '\n');
+    }
+
+    if (sk->emptyline[id]) {
+      if (!sink_begin_line(sk, id)) {
+        sink_index(sk);
+        if (has_pre) {
+          sink_put(sk, pre, prelen);
+          IND_PROBE2(prefix, id, prelen);
+        }
+      }
+      sk->emptyline[id] = 0;
+      sk->wrapper[id].col = has_pre && sk->cols ? text_width(pre) : 0;
+    }
+    if (sk->fd < 0) {
+      break;
+    }
+    if (sk->dropping[id] == DROP_NONE) {
+      if (sk->cols) {
+        wrap_put(sk, id, p, len, pre, post);
+      } else {
+        sink_put(sk, p, len);
+      }
+      if (has_post && q) {
+        sink_put(sk, post, postlen);
+      }
+    }
+    if (q) {
+      if (sk->dropping[id] != DROP_LINE) {
+        sink_put(sk, q, term);
+        sk->lines += q[term - 1] == '\n';
+      }
+      if (*q == '\r' && len + 1 == n) {
+        sk->cr[id] = sk->dropping[id] == DROP_LINE ? -1 : 1;
+      }
+      sk->dropping[id] = DROP_NONE;
+      sk->emptyline[id] = 1;
+      sk->complete = sk->buflen;
+      sk->holding = 0;
+      len += term;
+    } else if (sk->dropping[id] == DROP_NONE) {
+      sink_check_overrun(sk, id);
+      if (sk->buflen - sk->complete > line_max) {
+        sink_release(sk);
+      }
+    }
+    p += len;
+    n -= len;
+  }
+}
+
+#define SINK_TEXT(name, has_pre, has_post)                              \
+  static void                                                           \
+  name(struct sink *sk, int id, const char *p, size_t n)                \
+  {                                                                     \
+    sink_text_lines(sk, id, p, n, has_pre, has_post);                   \
+  }
+SINK_TEXT(sink_text_both, 1, 1)
+SINK_TEXT(sink_text_pre, 1, 0)      /* the default: "  " and "" */
+SINK_TEXT(sink_text_post, 0, 1)
+SINK_TEXT(sink_text_bare, 0, 0)
+#undef SINK_TEXT
+
+/**
+ * Set up a text sink's templates for a stream, and pick the sink_text_*()
+ * for them.
+ *
+ * @param   bail   exit(1) on a broken format
+ */
+static void
+sink_templates(struct sink *sk, int id, int bail)
+{
+  static sink_text_fn *const fns[2][2] = {
+    { sink_text_bare, sink_text_post },
+    { sink_text_pre, sink_text_both },
+  };
+
+  template_init(&sk->pre[id], sk->prefix[id], bail);
+  template_init(&sk->post[id], sk->postfix[id], bail);
+  sk->text[id] = fns[sk->pre[id].kind != TEMPLATE_EMPTY]
+                    [sk->post[id].kind != TEMPLATE_EMPTY];
+}
+
+/**
+ * Add one JSON Lines record for a complete line to the sink.
+ * A trailing CR (from a pty's ONLCR) is not part of the line.
+ *
+ * @param   sk    sink to write to
+ * @param   id    stream the line came from
+ * @param   line  line, without the terminating newline
+ * @param   len   length of line
+ */
+static void
+json_line(struct sink *sk, int id, const char *line, size_t len)
+{
+  struct timespec ts;
+  struct tm tm;
+  char tbuf[32];
+  char *rec, *p;
+
+  if (len && line[len - 1] == '\r') {
+    len--;
+  }
+  if (sink_begin_line(sk, id)) {
+    sk->dropping[id] = DROP_NONE;
+    return;
+  }
+
+  sink_index(sk);
+  clock_gettime(CLOCK_REALTIME, &ts);
+  gmtime_r(&ts.tv_sec, &tm);
+  strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%S", &tm);
+
+  p = rec = sink_reserve(sk, 128 + JSON_ESCAPE_MAX(len));
+  p += sprintf(p, "{\"stream\":\"%s\",\"time\":\"%s.%09ldZ\","
+               "\"seq\":%llu,\"line\":\"",
+               stream_names[id], tbuf, (long)ts.tv_nsec, ++sk->seq);
+  p += json_escape(p, line, len);
+  memcpy(p, "\"}\n", 3);
+  p += 3;
+  sk->buflen += p - rec;
+  sk->complete = sk->buflen;
+  sk->lines++;
+}
+
+/**
+ * Add one RFC 5424 record for a complete line to the sink. stdout lines
+ * are severity "info", stderr lines "err".
+ *
+ * @param   sk    sink to write to
+ * @param   id    stream the line came from
+ * @param   line  line, without the terminating newline
+ * @param   len   length of line
+ */
+static void
+syslog_line(struct sink *sk, int id, const char *line, size_t len)
+{
+  static const int severity[NSTREAMS] = { LOG_INFO, LOG_ERR };
+  struct timespec ts;
+  struct tm tm;
+  char tbuf[32];
+  char *rec, *p;
+
+  if (len && line[len - 1] == '\r') {
+    len--;
+  }
+  if (sink_begin_line(sk, id)) {
+    sk->dropping[id] = DROP_NONE;
+    return;
+  }
+  if (len > SYSLOG_MAX_MSG) {
+    len = SYSLOG_MAX_MSG;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  gmtime_r(&ts.tv_sec, &tm);
+  strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%S", &tm);
+
+  p = rec = sink_reserve(sk, 64 + strlen(syslog_tag) + len);
+  p += sprintf(p, "<%d>1 %s.%06ldZ %s - - ", LOG_USER | severity[id], tbuf,
+               (long)ts.tv_nsec / 1000, syslog_tag);
+  memcpy(p, line, len);
+  p += len;
+  sk->buflen += p - rec;
+  sink_end_record(sk, p - rec);
+}
+
+/**
+ * One complete line for a sink that takes whole lines.
+ */
+static void
+sink_record(struct sink *sk, int id, const char *line, size_t len)
+{
+  if (sk->syslog) {
+    syslog_line(sk, id, line, len);
+  } else {
+    json_line(sk, id, line, len);
+  }
+}
+
+/**
+ * Emit whatever is left of the current line, e.g. at EOF.
+ */
+static void
+line_flush(struct sink *sk, int id)
+{
+  struct linebuf *lb = &sk->line[id];
+  size_t len = lb->len;
+
+  if (!len) {
+    return;
+  }
+  lb->len = 0;
+  sink_record(sk, id, lb->buf, len);
+}
+
+/**
+ * Append to the partial line. If the line grows absurdly long it's
+ * emitted as a record of its own rather than growing forever.
+ */
+static void
+line_append(struct sink *sk, int id, const char *p, size_t n)
+{
+  struct linebuf *lb = &sk->line[id];
+
+  if (lb->len + n > lb->size) {
+    size_t newsize = lb->size ? lb->size : 128;
+    char *newbuf;
+
+    while (newsize < lb->len + n) {
+      newsize *= 2;
+    }
+    if (!(newbuf = realloc(lb->buf, newsize))) {
+      fprintf(stderr, "%s: Memory alloc of %zd bytes failed!\n",
+              argv0, newsize);
+      exit(1);
+    }
+    lb->buf = newbuf;
+    lb->size = newsize;
+  }
+  memcpy(lb->buf + lb->len, p, n);
+  lb->len += n;
+
+  if (lb->len >= max_indstr_length) {
+    line_flush(sk, id);
+  }
+}
+
+/**
+ * sink_text_lines() for sinks that take whole lines (JSON, syslog). Complete
+ * lines that are entirely inside the read buffer are used straight from
+ * it, without copying.
+ */
+static void
+sink_lines(struct sink *sk, int id, const char *p, size_t n)
+{
+  const char *q;
+
+  while ((q = memchr(p, '\n', n))) {
+    size_t len = q - p;
+
+    if (sk->line[id].len) {
+      line_append(sk, id, p, len);
+      line_flush(sk, id);
+    } else {
+      sink_record(sk, id, p, len);
+    }
+    n -= len + 1;
+    p = q + 1;
+  }
+  if (n) {
+    line_append(sk, id, p, n);
+  }
+}
+
+/**
+ * --record: add a chunk to the recording. If writing the recording fails
+ * it's abandoned, but the command keeps running.
+ */
+static void
+record(int type, const char *p, size_t n)
+{
+  if (recorder && rec_write(recorder, type, p, n)) {
+    fprintf(stderr, "%s: writing recording: %s, recording stopped\n",
+            argv0, strerror(errno));
+    recorder = NULL;
+  }
+}
+
+/**
+ * Hand data from one of the child's streams to every sink that wants it.
+ *
+ * @param   id         which stream this is
+ * @param   buf, n     the data
+ * @param   only       if not NULL, write only to this sink (used to echo
+ *                     terminal input, which doesn't belong in logs)
+ *
+ * @return  0 if someone is still listening, !0 if all sinks are gone
+ */
+static int
+sinks_write(int id, const char *buf, size_t n, struct sink *only)
+{
+  struct sink *sk;
+  int alive = 0;
+
+  for (sk = sinks; sk; sk = sk->next) {
+    const char *p = buf;
+    size_t len = n;
+    long long t0;
+
+    if (sk->fd < 0 || (only ? sk != only : !(sk->streams & (1 << id)))) {
+      continue;
+    }
+    t0 = tracer ? trace_now() : 0;
+    if (sk->strip & (1 << id)) {
+      len = sink_strip(sk, id, &p, n);
+    }
+    if (!len) {
+      /* all escape codes */
+    } else if (sk->json || sk->syslog) {
+      sink_lines(sk, id, p, len);
+    } else {
+      template_update(&sk->pre[id]);
+      template_update(&sk->post[id]);
+      sk->text[id](sk, id, p, len);
+    }
+    if (tracer) {
+      trace_add(tracer, "format", sk->fd, t0);
+    }
+    /* the terminal is written right away, the others in batches */
+    if (sk->blocking || sink_batch_full(sk)) {
+      sink_flush(sk);
+    }
+    if (0 <= sk->fd) {
+      alive = 1;
+    }
+  }
+  return !alive;
+}
+
+/**
+ * One of the child's streams has ended. Finish off any partial lines.
+ */
+static void
+sinks_eof(int id)
+{
+  struct sink *sk;
+
+  for (sk = sinks; sk; sk = sk->next) {
+    if (sk->fd >= 0 && (sk->json || sk->syslog)
+        && (sk->streams & (1 << id))) {
+      line_flush(sk, id);
+      if (sk->blocking) {
+        sink_flush(sk);
+      }
+    }
+  }
+}
+
+/**
+ * --screen: the command's output goes into the screen model instead of
+ * being annotated line by line. Its stderr is a pipe rather than the pty,
+ * so newlines there get the carriage return the pty would have added.
+ *
+ * @param   fdin       where the data came from, to answer queries on
+ * @param   id         which stream this is
+ * @param   buf        data
+ * @param   n          length of data
+ */
+static void
+screen_input(int fdin, int id, const char *buf, size_t n)
+{
+  const char *p;
+
+  if (id == STREAM_STDOUT) {
+    screen_feed(screen, buf, n);
+  } else {
+    while ((p = memchr(buf, '\n', n))) {
+      screen_feed(screen, buf, p - buf);
+      screen_feed(screen, "\r\n", 2);
+      n -= p - buf + 1;
+      buf = p + 1;
+    }
+    screen_feed(screen, buf, n);
+  }
+
+  /* cursor position and device attribute reports */
+  if (screen->replylen) {
+    if (id == STREAM_STDOUT) {
+      safe_write(fdin, screen->reply, screen->replylen);
+    }
+    screen->replylen = 0;
+  }
+}
+
+/**
+ * --screen: write pending changes to the terminal, unless the last update
+ * was less than SCREEN_FRAME_MS ago. A program redrawing in many small
+ * writes then costs one update per frame, not one per write.
+ *
+ * @param   tv      timeout storage, possibly already holding the timeout
+ * @param   tvp     select() timeout so far, NULL for none
+ * @param   force   update now, regardless of the frame rate
+ *
+ * @return  select() timeout, shortened to when the next update is due
+ */
+static struct timeval *
+screen_update(struct timeval *tv, struct timeval *tvp, int force)
+{
+  struct timespec now;
+  long long wait;
+  long long t0;
+  char *pre;
+
+  if (!screen_dirty(screen)) {
+    return tvp;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  wait = SCREEN_FRAME_MS * 1000LL
+    - ((now.tv_sec - screen_rendered.tv_sec) * 1000000LL
+       + (now.tv_nsec - screen_rendered.tv_nsec) / 1000);
+  if (wait > 0 && !force) {
+    if (!tvp || tvp->tv_sec * 1000000LL + tvp->tv_usec > wait) {
+      tv->tv_sec = 0;
+      tv->tv_usec = wait;
+      tvp = tv;
+    }
+    return tvp;
+  }
+
+  t0 = tracer ? trace_now() : 0;
+  format(screen_prefix, &pre, 0);
+  screen_render(screen, pre, strlen(pre));
+  free(pre);
+  if (tracer) {
+    trace_add(tracer, "render", -1, t0);
+    t0 = trace_now();
+  }
+  if (0 > safe_write(STDOUT_FILENO, screen->out, screen->outlen)) {
+    fprintf(stderr, "%s: write(stdout): %s\n", argv0, strerror(errno));
+  }
+  if (tracer) {
+    trace_add(tracer, "write", STDOUT_FILENO, t0);
+  }
+  screen->outlen = 0;
+  screen_rendered = now;
+  return tvp;
+}
+
+/**
+ * --gap-report: keep a gap if it's one of the gap_max longest so far.
+ * The shortest kept one is at the top of the heap, to be pushed out.
+ */
+static void
+gap_add(long long ns, long long at, int id, const char *before,
+        const char *after)
+{
+  struct gap *g;
+  unsigned c, child;
+
+  if (gap_n < gap_max) {
+    /* sift up from the bottom */
+    for (c = gap_n++; c && gaps[(c - 1) / 2].ns > ns; c = (c - 1) / 2) {
+      gaps[c] = gaps[(c - 1) / 2];
+    }
+  } else if (ns > gaps[0].ns) {
+    /* replace the top and sift down */
+    for (c = 0; (child = 2 * c + 1) < gap_n; c = child) {
+      if (child + 1 < gap_n && gaps[child + 1].ns < gaps[child].ns) {
+        child++;
+      }
+      if (gaps[child].ns >= ns) {
+        break;
+      }
+      gaps[c] = gaps[child];
+    }
+  } else {
+    return;
+  }
+  g = &gaps[c];
+  g->ns = ns;
+  g->at = at - gap_epoch;
+  g->id = id;
+  strcpy(g->before, before);
+  strcpy(g->after, after);
+}
+
+/**
+ * --gap-report: find the ends of lines in what a stream just gave us, and
+ * time the silences between them. Everything read at once counts as
+ * arriving at the same time.
+ */
+static void
+gap_scan(int id, const char *buf, size_t n)
+{
+  const char *end = buf + n;
+  const char *nl;
+  long long now = trace_now();
+
+  for (; buf < end; buf = nl + 1) {
+    const char *q;
+
+    nl = memchr(buf, '\n', end - buf);
+    /* the start of the line, without control characters */
+    for (q = buf; q < (nl ? nl : end)
+           && gap_streams[id].curlen < GAP_TEXT; q++) {
+      if ((unsigned char)*q >= ' ' && *q != 0x7f) {
+        gap_streams[id].cur[gap_streams[id].curlen++] = *q;
+      }
+    }
+    if (!nl) {
+      break;
+    }
+    gap_streams[id].cur[gap_streams[id].curlen] = 0;
+    if (gap_streams[id].end) {
+      gap_add(now - gap_streams[id].end, now, id, gap_streams[id].last,
+              gap_streams[id].cur);
+    }
+    gap_streams[id].end = now;
+    memcpy(gap_streams[id].last, gap_streams[id].cur,
+           gap_streams[id].curlen + 1);
+    gap_streams[id].curlen = 0;
+  }
+}
+
+/**
+ * Main functionality function.
+ * Read from fdin, and hand the data to every sink that wants this stream.
+ *
+ * @param   fdin       source fd
+ * @param   id         which stream this is
+ * @param   only       if not NULL, write only to this sink (used to echo
+ *                     terminal input, which doesn't belong in logs)
+ *
+ * @return        0 on success, !0 on "no more data will be readable ever"
+ */
+static int
+process(int fdin, int id, struct sink *only)
+{
+  int n;
+  char buf[READ_SIZE];
+  const char *p = buf;
+  struct nest_layer *l;
+  long long t0 = tracer ? trace_now() : 0;
 
   n = read(fdin, buf, sizeof(buf)-1);
+  if (tracer) {
+    trace_add(tracer, "read", fdin, t0);
+  }
+  IND_PROBE2(read, fdin, n);
   if (verbose > 1) {
     fprintf(stderr, "%s: read(%d): %d (errno=%s)\n", argv0, fdin, n,
 	    strerror(errno));
   }
-  if (!n) {
-    goto errout;
+  if (!n) {
+    goto errout;
+  }
+
+  if (0 > n) {
+    switch(errno) {
+      /* non-fatal errors */
+    case EAGAIN:
+    case EINTR:
+      return 0;
+      
+      /* these mean internal error */
+    case EFAULT:
+    case EINVAL:
+    case EBADF:
+    case EISDIR:
+      fprintf(stderr, "%s: Internal error: read() got errno %d (%s)\n",
+	      argv0, errno, strerror(errno));
+      exit(1);
+
+      /* these errors mean we may as well close the whole fd */
+    case EIO:
+    default:
+	goto errout;
+    }
+  }
+  if (!only) {
+    stream_stats[id].reads++;
+    stream_stats[id].bytes += n;
+    if (extra_stats) {
+      const char *q = buf;
+      while ((q = memchr(q, '\n', buf + n - q))) {
+        stream_stats[id].lines++;
+        q++;
+      }
+    }
+    if (gap_max) {
+      gap_scan(id, buf, n);
+    }
+  }
+
+  /* the work of any nested inds, innermost first */
+  for (l = nest_layers; l && !only; l = l->next) {
+    nest_text(l, id, p, n);
+    p = l->buf;
+    n = l->buflen;
+  }
+
+  if (!only) {
+    record(id == STREAM_STDOUT ? REC_STDOUT : REC_STDERR, p, n);
+  }
+
+  if (screen) {
+    screen_input(fdin, id, p, n);
+    if (only) {
+      return 0;
+    }
+  }
+
+  /* keep reading as long as someone is listening */
+  if (sinks_write(id, p, n, only) && !only && !screen) {
+    do_close(fdin);
+    return 1;
+  }
+  return 0;
+
+ errout:
+  sinks_eof(id);
+  return 1;
+}
+
+/**
+ * Remember when a stream was first seen with data waiting.
+ */
+static void
+sched_mark(int id, int ready, const struct timespec *now)
+{
+  struct stream_stats *st = &stream_stats[id];
+
+  if (ready && !st->waiting) {
+    st->waiting = 1;
+    st->since = *now;
+  }
+}
+
+/**
+ * Read the command's stdout and stderr. Each gets at most read_budget
+ * reads per round, so neither can keep the other (or sinks and timers)
+ * waiting for long. Between reads the --priority stream goes first
+ * whenever it has something, so error messages aren't stuck behind bulk
+ * output.
+ *
+ * @param   fds     what select() found readable
+ * @param   in      ind_stdin, closed along with stdout if it's the same fd
+ * @param   out     ind_stdout, set to -1 when closed
+ * @param   err     ind_stderr, set to -1 when closed
+ */
+static void
+sched_read(fd_set *fds, int *in, int *out, int *err)
+{
+  static int turn = STREAM_STDOUT;
+  int *fd[NSTREAMS];
+  int ready[NSTREAMS];
+  unsigned left[NSTREAMS];
+  struct timespec now;
+  int id;
+
+  fd[STREAM_STDOUT] = out;
+  fd[STREAM_STDERR] = err;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (id = 0; id < NSTREAMS; id++) {
+    left[id] = read_budget;
+    ready[id] = -1 < *fd[id] && FD_ISSET(*fd[id], fds);
+    sched_mark(id, ready[id], &now);
+  }
+
+  for (;;) {
+    struct stream_stats *st;
+    unsigned long long before;
+    long long delay;
+
+    if (read_first < 0) {
+      id = turn;
+      turn = !turn;
+    } else {
+      id = read_first;
+    }
+    if (!ready[id] || !left[id]) {
+      id = !id;
+      if (!ready[id] || !left[id]) {
+        break;
+      }
+    }
+
+    st = &stream_stats[id];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    delay = (now.tv_sec - st->since.tv_sec) * 1000000LL
+      + (now.tv_nsec - st->since.tv_nsec) / 1000;
+    if (delay > st->max_delay) {
+      st->max_delay = delay;
+    }
+    st->waiting = 0;
+    left[id]--;
+    before = st->bytes;
+    if (verbose > 1) {
+      fprintf(stderr, "%s: read()ing %s\n", argv0, stream_names[id]);
+    }
+    if (process(*fd[id], id, NULL)) {
+      if (id == STREAM_STDOUT && *in == *out) {
+        *in = -1;
+      }
+      *fd[id] = -1;
+    }
+
+    /* a short read means that's all for now. Otherwise, see what's come
+     * in since, on both streams. */
+    if (*fd[id] < 0 || st->bytes - before < READ_SIZE - 1) {
+      ready[id] = 0;
+    } else {
+      fd_set rfds;
+      struct timeval tv = { 0, 0 };
+      int fdmax = -1;
+
+      FD_ZERO(&rfds);
+      do_fdset(&rfds, *out, &fdmax);
+      do_fdset(&rfds, *err, &fdmax);
+      if (0 > select(fdmax + 1, &rfds, NULL, NULL, &tv)) {
+        break;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      for (id = 0; id < NSTREAMS; id++) {
+        ready[id] = -1 < *fd[id] && FD_ISSET(*fd[id], &rfds);
+        sched_mark(id, ready[id], &now);
+      }
+    }
+  }
+}
+
+/**
+ * Before exiting: give every sink a chance to write what it has left.
+ * Sinks that would rather drop data than block get one last try.
+ */
+static void
+sinks_drain(void)
+{
+  struct sink *sk;
+
+  for (sk = sinks; sk; sk = sk->next) {
+    if (sk->fd < 0) {
+      continue;
+    }
+    sink_release(sk);
+    if (sk->policy == SINK_BLOCK) {
+      sink_drain(sk, 0);
+    } else {
+      sink_flush(sk);
+    }
+    if (sk->dropped) {
+      fprintf(stderr, "%s: %s: dropped %llu lines\n",
+              argv0, sk->name, sk->dropped);
+    }
+  }
+}
+
+/**
+ * --trace-file: write out the events.
+ */
+static void
+trace_finish(void)
+{
+  if (tracer && trace_close(tracer, (long)getpid())) {
+    fprintf(stderr, "%s: writing trace: %s\n", argv0, strerror(errno));
+  }
+}
+
+/**
+ * Write a Prometheus label value, escaped.
+ */
+static void
+metrics_label(FILE *f, const char *s)
+{
+  for (; *s; s++) {
+    if (*s == '\\' || *s == '"') {
+      fprintf(f, "\\%c", *s);
+    } else if (*s == '\n') {
+      fputs("\\n", f);
+    } else {
+      fputc(*s, f);
+    }
+  }
+}
+
+/**
+ * Start a metric: its help text and type.
+ */
+static void
+metrics_head(FILE *f, const char *name, const char *type, const char *help)
+{
+  fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Start a sample of a per-sink metric.
+ */
+static void
+metrics_sink(FILE *f, const char *name, const struct sink *sk)
+{
+  fprintf(f, "%s{sink=\"", name);
+  metrics_label(f, sk->name);
+  fputs("\"} ", f);
+}
+
+/**
+ * Write all metrics, in the Prometheus text format.
+ *
+ * @param   f       where to
+ * @param   status  the command's wait() status, or -1 if it's running
+ */
+static void
+metrics_write(FILE *f, int status)
+{
+  const struct sink *sk;
+  int id;
+
+  metrics_head(f, "ind_read_bytes_total", "counter",
+               "Bytes read from the command.");
+  for (id = 0; id < NSTREAMS; id++) {
+    fprintf(f, "ind_read_bytes_total{stream=\"%s\"} %llu\n",
+            stream_names[id], stream_stats[id].bytes);
+  }
+  metrics_head(f, "ind_read_lines_total", "counter",
+               "Lines read from the command.");
+  for (id = 0; id < NSTREAMS; id++) {
+    fprintf(f, "ind_read_lines_total{stream=\"%s\"} %llu\n",
+            stream_names[id], stream_stats[id].lines);
+  }
+  metrics_head(f, "ind_reads_total", "counter",
+               "Reads from the command's output.");
+  for (id = 0; id < NSTREAMS; id++) {
+    fprintf(f, "ind_reads_total{stream=\"%s\"} %llu\n",
+            stream_names[id], stream_stats[id].reads);
+  }
+  metrics_head(f, "ind_read_delay_max_seconds", "gauge",
+               "Longest time output waited to be read.");
+  for (id = 0; id < NSTREAMS; id++) {
+    fprintf(f, "ind_read_delay_max_seconds{stream=\"%s\"} %lld.%06lld\n",
+            stream_names[id], stream_stats[id].max_delay / 1000000,
+            stream_stats[id].max_delay % 1000000);
+  }
+
+  metrics_head(f, "ind_sink_written_bytes_total", "counter",
+               "Bytes written to a sink.");
+  for (sk = sinks; sk; sk = sk->next) {
+    metrics_sink(f, "ind_sink_written_bytes_total", sk);
+    fprintf(f, "%llu\n", sk->written);
+  }
+  metrics_head(f, "ind_sink_dropped_lines_total", "counter",
+               "Lines dropped because a sink was behind.");
+  for (sk = sinks; sk; sk = sk->next) {
+    metrics_sink(f, "ind_sink_dropped_lines_total", sk);
+    fprintf(f, "%llu\n", sk->dropped);
+  }
+  metrics_head(f, "ind_sink_blocked_seconds_total", "counter",
+               "Time spent waiting for a blocking sink.");
+  for (sk = sinks; sk; sk = sk->next) {
+    metrics_sink(f, "ind_sink_blocked_seconds_total", sk);
+    fprintf(f, "%llu.%09llu\n", sk->blocked_ns / 1000000000,
+            sk->blocked_ns % 1000000000);
+  }
+  metrics_head(f, "ind_sink_connected", "gauge",
+               "1 until the sink is disconnected.");
+  for (sk = sinks; sk; sk = sk->next) {
+    metrics_sink(f, "ind_sink_connected", sk);
+    fprintf(f, "%d\n", sk->fd >= 0);
+  }
+
+  metrics_head(f, "ind_child_running", "gauge",
+               "1 while the command is running.");
+  fprintf(f, "ind_child_running %d\n", status < 0);
+  if (status >= 0) {
+    metrics_head(f, "ind_child_exit_code", "gauge",
+                 "The command's exit code, 128 + signal if killed.");
+    fprintf(f, "ind_child_exit_code %d\n", exit_code(status));
+  }
+}
+
+/**
+ * --metrics-file: replace the file with current metrics. Written next to
+ * it and renamed, so a collector never sees half a file.
+ */
+static void
+metrics_save(int status)
+{
+  char *tmp;
+  FILE *f;
+
+  if (!(tmp = malloc(strlen(metrics_file) + 32))) {
+    return;
+  }
+  sprintf(tmp, "%s.%ld.tmp", metrics_file, (long)getpid());
+  if (!(f = fopen(tmp, "w"))) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, tmp, strerror(errno));
+    free(tmp);
+    return;
+  }
+  metrics_write(f, status);
+  if (fclose(f) || rename(tmp, metrics_file)) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, metrics_file, strerror(errno));
+    unlink(tmp);
+  }
+  free(tmp);
+  clock_gettime(CLOCK_MONOTONIC, &metrics_written);
+}
+
+/**
+ * --metrics-file: save metrics if it's time, and work out how long
+ * select() may sleep until it's time again.
+ *
+ * @return  select() timeout, shortened to when metrics are next due
+ */
+static struct timeval *
+metrics_update(struct timeval *tv, struct timeval *tvp, int status)
+{
+  struct timespec now;
+  long long wait;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  wait = metrics_interval_ms * 1000LL
+    - ((now.tv_sec - metrics_written.tv_sec) * 1000000LL
+       + (now.tv_nsec - metrics_written.tv_nsec) / 1000);
+  if (wait <= 0) {
+    metrics_save(status);
+    wait = metrics_interval_ms * 1000LL;
+  }
+  if (!tvp || tvp->tv_sec * 1000000LL + tvp->tv_usec > wait) {
+    tv->tv_sec = wait / 1000000;
+    tv->tv_usec = wait % 1000000;
+    tvp = tv;
+  }
+  return tvp;
+}
+
+/**
+ * --metrics-socket: a scraper connected. Give it the metrics and hang up.
+ * They fit in the socket buffer, so this doesn't block.
+ */
+static void
+metrics_serve(int status)
+{
+  int fd;
+  FILE *f;
+
+  if (0 > (fd = accept(metrics_sock, NULL, NULL))) {
+    return;
+  }
+  if (!(f = fdopen(fd, "w"))) {
+    do_close(fd);
+    return;
+  }
+  metrics_write(f, status);
+  fclose(f);
+}
+
+/**
+ * Listen on a Unix socket, replacing a stale one.
+ *
+ * @return  listening socket
+ */
+static int
+metrics_listen(const char *path)
+{
+  struct sockaddr_un sa;
+  int fd;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(sa.sun_path)) {
+    fprintf(stderr, "%s: %s: path too long\n", argv0, path);
+    exit(1);
+  }
+  strcpy(sa.sun_path, path);
+  unlink(path);
+  if (0 > (fd = socket(AF_UNIX, SOCK_STREAM, 0))
+      || bind(fd, (struct sockaddr *)&sa, sizeof(sa))
+      || listen(fd, 8)) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, path, strerror(errno));
+    exit(1);
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+/**
+ * Human readable byte count.
+ */
+static void
+status_bytes(char *buf, size_t size, double n)
+{
+  static const char units[] = "BkMGTP";
+  int u = 0;
+
+  while (n >= 1000 && units[u + 1]) {
+    n /= 1000;
+    u++;
+  }
+  snprintf(buf, size, u ? "%.1f%c" : "%.0f%c", n, units[u]);
+}
+
+/**
+ * --status: put the current status line in buf.
+ */
+static void
+status_text(char *buf, size_t size)
+{
+  static struct stream_stats last[NSTREAMS];
+  static struct timespec last_time;
+  static double last_cpu;
+  struct timespec now;
+  struct rusage ru;
+  double dt, cpu;
+  long long el;
+  size_t len;
+  int id;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  getrusage(RUSAGE_SELF, &ru);
+  cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+    + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  if (!last_time.tv_sec && !last_time.tv_nsec) {
+    last_time = status_start;
+    last_cpu = cpu;
+  }
+  dt = (now.tv_sec - last_time.tv_sec)
+    + (now.tv_nsec - last_time.tv_nsec) / 1e9;
+  if (dt <= 0) {
+    dt = 1e-9;
+  }
+  el = now.tv_sec - status_start.tv_sec;
+
+  len = snprintf(buf, size, "ind %lld:%02lld:%02lld", el / 3600,
+                 el / 60 % 60, el % 60);
+  for (id = 0; id < NSTREAMS && len < size; id++) {
+    const struct stream_stats *st = &stream_stats[id];
+    char total[16], rate[16];
+
+    status_bytes(total, sizeof(total), st->bytes);
+    status_bytes(rate, sizeof(rate), (st->bytes - last[id].bytes) / dt);
+    len += snprintf(buf + len, size - len, " | %s %s %s/s %.0f lines/s",
+                    stream_names[id], total, rate,
+                    (st->lines - last[id].lines) / dt);
+    last[id] = *st;
+  }
+  if (len < size) {
+    snprintf(buf + len, size - len, " | cpu %.1f%%",
+             100 * (cpu - last_cpu) / dt);
+  }
+  last_cpu = cpu;
+  last_time = now;
+}
+
+/**
+ * --status: draw the status line.
+ */
+static void
+status_draw(void)
+{
+  char text[256];
+  char out[sizeof(text) + 32];
+  int n, c;
+
+  clock_gettime(CLOCK_MONOTONIC, &status_drawn);
+  status_text(text, sizeof(text));
+  if (status_mode == STATUS_BOTTOM) {
+    n = snprintf(out, sizeof(out), "\0337\033[%d;1H\033[m\033[2K%.*s\0338",
+                 status_rows, status_cols, text);
+    if (0 > safe_write(STDOUT_FILENO, out, n)) {
+      /* nothing to be done */
+    }
+    return;
+  }
+
+  /* on stderr: only between lines, or it would cut one up */
+  for (c = 0; c < 2; c++) {
+    const struct sink *sk = status_share[c];
+    if (sk && (!sk->emptyline[STREAM_STDOUT] || !sk->emptyline[STREAM_STDERR]
+               || sk->buflen)) {
+      return;
+    }
+  }
+  n = snprintf(out, sizeof(out), "\r%.*s\033[K",
+               status_cols ? status_cols - 1 : 79, text);
+  if (0 > safe_write(STDERR_FILENO, out, n)) {
+    /* nothing to be done */
+  }
+  status_shown = 1;
+}
+
+/**
+ * --status: set the scroll region to all but the last row.
+ */
+static void
+status_region(void)
+{
+  struct winsize ws;
+  char out[64];
+  int n;
+
+  if (ioctl(status_mode == STATUS_BOTTOM ? STDOUT_FILENO : STDERR_FILENO,
+            TIOCGWINSZ, &ws) || !ws.ws_col) {
+    ws.ws_row = 24;
+    ws.ws_col = 80;
+  }
+  status_rows = ws.ws_row;
+  status_cols = ws.ws_col;
+  if (status_mode != STATUS_BOTTOM) {
+    return;
+  }
+  /* setting the region moves the cursor, so save and restore it */
+  n = snprintf(out, sizeof(out), "\0337\033[1;%dr\0338", status_rows - 1);
+  if (0 > safe_write(STDOUT_FILENO, out, n)) {
+    /* nothing to be done */
+  }
+}
+
+/**
+ * --status: start. For the bottom row, make room for it first: if the
+ * cursor is on the last row, the output there would be overwritten.
+ */
+static void
+status_begin(struct sink *term_out, struct sink *term_err)
+{
+  struct stat st_out, st_err;
+
+  clock_gettime(CLOCK_MONOTONIC, &status_start);
+  if (status_mode == STATUS_BOTTOM) {
+    if (0 > safe_write(STDOUT_FILENO, "\n\033[A", 4)) {
+      /* nothing to be done */
+    }
+  } else {
+    status_share[0] = term_err;
+    if (!fstat(STDOUT_FILENO, &st_out) && !fstat(STDERR_FILENO, &st_err)
+        && st_out.st_rdev == st_err.st_rdev && isatty(STDOUT_FILENO)) {
+      status_share[1] = term_out;
+    }
+  }
+  status_region();
+  status_draw();
+}
+
+/**
+ * --status: redraw if it's time, and work out how long select() may sleep
+ * until it's time again.
+ *
+ * @return  select() timeout, shortened to when the status is next due
+ */
+static struct timeval *
+status_update(struct timeval *tv, struct timeval *tvp)
+{
+  struct timespec now;
+  long long wait;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  wait = STATUS_INTERVAL_MS * 1000LL
+    - ((now.tv_sec - status_drawn.tv_sec) * 1000000LL
+       + (now.tv_nsec - status_drawn.tv_nsec) / 1000);
+  if (wait <= 0) {
+    status_draw();
+    wait = STATUS_INTERVAL_MS * 1000LL;
+  }
+  if (!tvp || tvp->tv_sec * 1000000LL + tvp->tv_usec > wait) {
+    tv->tv_sec = wait / 1000000;
+    tv->tv_usec = wait % 1000000;
+    tvp = tv;
+  }
+  return tvp;
+}
+
+/**
+ * --status: put the terminal back the way it was.
+ */
+static void
+status_end(void)
+{
+  char out[64];
+  int n;
+
+  if (status_mode == STATUS_BOTTOM) {
+    n = snprintf(out, sizeof(out), "\0337\033[r\033[%d;1H\033[2K\0338",
+                 status_rows);
+    if (0 > safe_write(STDOUT_FILENO, out, n)) {
+      /* nothing to be done */
+    }
+  } else if (status_shown) {
+    status_hide();
+  }
+}
+
+/**
+ * %{rss}, %{cpu}, %{threads}: read the command's /proc/<pid>/stat and
+ * statm into format_vars. Only on a timer, never per line. Where there's
+ * no /proc, they stay "-".
+ *
+ * @param   pid     the command
+ */
+static void
+proc_sample(pid_t pid)
+{
+  static long tick_hz, page_kb;
+  struct timespec now;
+  unsigned long long utime, stime;
+  unsigned long resident;
+  long threads;
+  char path[64];
+  char buf[1024];
+  const char *p;
+  double kb;
+  ssize_t n;
+  int fd;
+
+  if (!tick_hz) {
+    tick_hz = sysconf(_SC_CLK_TCK);
+    page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  /* "pid (comm) state ppid ...". comm can have spaces and parens. */
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  if (0 > (fd = open(path, O_RDONLY))) {
+    return;
+  }
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return;
+  }
+  buf[n] = 0;
+  if (!(p = strrchr(buf, ')'))
+      || 3 != sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                     "%llu %llu %*d %*d %*d %*d %ld",
+                     &utime, &stime, &threads)) {
+    return;
+  }
+  snprintf(format_vars.threads, sizeof(format_vars.threads), "%ld",
+           threads);
+  format_vars_gen++;
+  if (proc_sampled.tv_sec) {
+    double wall = (now.tv_sec - proc_sampled.tv_sec)
+      + (now.tv_nsec - proc_sampled.tv_nsec) / 1e9;
+    if (wall > 0) {
+      snprintf(format_vars.cpu, sizeof(format_vars.cpu), "%.1f",
+               100.0 * (utime + stime - proc_ticks) / tick_hz / wall);
+    }
+  }
+  proc_ticks = utime + stime;
+  proc_sampled = now;
+
+  snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+  if (0 > (fd = open(path, O_RDONLY))) {
+    return;
+  }
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return;
+  }
+  buf[n] = 0;
+  if (1 != sscanf(buf, "%*u %lu", &resident)) {
+    return;
+  }
+  kb = (double)resident * page_kb;
+  if (kb < 1024) {
+    snprintf(format_vars.rss, sizeof(format_vars.rss), "%.0fk", kb);
+  } else if (kb < 1024 * 1024) {
+    snprintf(format_vars.rss, sizeof(format_vars.rss), "%.1fM", kb / 1024);
+  } else {
+    snprintf(format_vars.rss, sizeof(format_vars.rss), "%.2fG",
+             kb / (1024 * 1024));
+  }
+}
+
+/**
+ * %{rss}, %{cpu}, %{threads}: sample the command if it's time, and make
+ * sure select() wakes up for the next time.
+ *
+ * @param   pid   the command
+ * @param   tv    timeout storage
+ * @param   tvp   select() timeout so far, NULL for none
+ *
+ * @return  the timeout to use
+ */
+static struct timeval *
+proc_update(pid_t pid, struct timeval *tv, struct timeval *tvp)
+{
+  struct timespec now;
+  long long wait;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  wait = PROC_INTERVAL_MS * 1000LL
+    - ((now.tv_sec - proc_sampled.tv_sec) * 1000000LL
+       + (now.tv_nsec - proc_sampled.tv_nsec) / 1000);
+  if (wait <= 0) {
+    proc_sample(pid);
+    /* even if it failed, don't try again right away */
+    proc_sampled = now;
+    wait = PROC_INTERVAL_MS * 1000LL;
+  }
+  if (!tvp || tvp->tv_sec * 1000000LL + tvp->tv_usec > wait) {
+    tv->tv_sec = wait / 1000000;
+    tv->tv_usec = wait % 1000000;
+    tvp = tv;
+  }
+  return tvp;
+}
+
+/**
+ * waitpid(), and the child's resource usage if it's done.
+ */
+static pid_t
+wait_child(pid_t pid, int *status, int options, struct rusage *ru)
+{
+#ifdef HAVE_WAIT4
+  return wait4(pid, status, options, ru);
+#else
+  pid_t ret = waitpid(pid, status, options);
+  if (ret == pid) {
+    getrusage(RUSAGE_CHILDREN, ru);
+  }
+  return ret;
+#endif
+}
+
+/**
+ * @return  timeval in seconds
+ */
+static double
+tv_sec(const struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/**
+ * Write a report at exit as a line of the command's stderr, on a line of
+ * its own.
+ *
+ * @param   text    the line, without newline
+ */
+static void
+report_line(const char *text)
+{
+  struct sink *sk;
+  char line[1024];
+  size_t n;
+  int c;
+
+  /* finish partial lines rather than tack onto them. On a shared fd (the
+   * terminal) that includes stdout's. */
+  for (sk = sinks; sk; sk = sk->next) {
+    for (c = 0; c < NSTREAMS; c++) {
+      if (sk->fd >= 0 && (sk->streams & (1 << c)) && !sk->emptyline[c]
+          && (c == STREAM_STDERR || sk->blocking)) {
+        sinks_write(c, "\n", 1, sk);
+      }
+    }
+  }
+  n = snprintf(line, sizeof(line), "%s\n", text);
+  if (n >= sizeof(line)) {
+    n = sizeof(line) - 1;
+    line[n - 1] = '\n';
   }
+  sinks_write(STREAM_STDERR, line, n, NULL);
+}
 
-  if (0 > n) {
-    switch(errno) {
-      /* non-fatal errors */
-    case EAGAIN:
-    case EINTR:
-      goto okout;
-      
-      /* these mean internal error */
-    case EFAULT:
-    case EINVAL:
-    case EBADF:
-    case EISDIR:
-      fprintf(stderr, "%s: Internal error: read() got errno %d (%s)\n",
-	      argv0, errno, strerror(errno));
-      exit(1);
+/**
+ * sort gaps longest first
+ */
+static int
+gap_cmp(const void *a, const void *b)
+{
+  const struct gap *ga = a, *gb = b;
+  return (ga->ns < gb->ns) - (ga->ns > gb->ns);
+}
 
-      /* these errors mean we may as well close the whole fd */
-    case EIO:
-    default:
-	goto errout;
-    }
-  } else {
-    char *p = buf;
-    char *q;
+/**
+ * --gap-report: list the longest gaps, as lines of the command's stderr.
+ */
+static void
+gap_print(void)
+{
+  char line[512];
+  unsigned c;
 
-    format(prefix, &pre, 0);
-    format(postfix, &post, 0);
+  if (!gap_n) {
+    report_line("gaps: no two lines on a stream to time");
+    return;
+  }
+  qsort(gaps, gap_n, sizeof(struct gap), gap_cmp);
+  snprintf(line, sizeof(line), "gaps: the %u longest silences between "
+           "lines, and when they ended", gap_n);
+  report_line(line);
+  for (c = 0; c < gap_n; c++) {
+    const struct gap *g = &gaps[c];
+    snprintf(line, sizeof(line), "gaps: %2u. %9.3fs  %s  at %9.3fs  "
+             "\"%s\" -> \"%s\"", c + 1, g->ns / 1e9, stream_names[g->id],
+             g->at / 1e9, g->before, g->after);
+    report_line(line);
+  }
+}
 
-    while ((q = mempbrk(p,"\r\n",n))) {
-      if (*emptyline) {
-	if (0 > safe_write(fdout,pre,strlen(pre))) {
-	  goto errout;
-	}
-	*emptyline = 0;
-      }
-      if (0 > safe_write(fdout,p,q-p)) {
-	goto errout;
-      }
-      if (0 > safe_write(fdout,post,strlen(post))) {
-	goto errout;
-      }
-      if (0 > safe_write(fdout,q,1)) {
-	goto errout;
+/**
+ * --rusage: report what the command used, and what ind itself used, as a
+ * line of the command's stderr.
+ *
+ * @param   ru      the command's usage, from wait4()
+ * @param   wall    the command's run time, in seconds
+ */
+static void
+rusage_line(const struct rusage *ru, double wall)
+{
+  struct rusage self;
+  char line[512];
+  double cpu;
+  long maxrss = ru->ru_maxrss;
+  size_t n = 0;
+
+#ifdef __APPLE__
+  maxrss /= 1024;   /* bytes, not kB */
+#endif
+  getrusage(RUSAGE_SELF, &self);
+  cpu = tv_sec(&ru->ru_utime) + tv_sec(&ru->ru_stime);
+
+  n = snprintf(line, sizeof(line),
+                "rusage: %.3fs real, %.3fs user, %.3fs sys, %ld kB max RSS, "
+                "%ld+%ld major+minor faults, "
+                "%ld+%ld voluntary+involuntary context switches, "
+                "%ld+%ld blocks in+out. ind: %.3fs user, %.3fs sys",
+                wall, tv_sec(&ru->ru_utime), tv_sec(&ru->ru_stime), maxrss,
+                ru->ru_majflt, ru->ru_minflt, ru->ru_nvcsw, ru->ru_nivcsw,
+                ru->ru_inblock, ru->ru_oublock,
+                tv_sec(&self.ru_utime), tv_sec(&self.ru_stime));
+  if (cpu > 0 && n < sizeof(line)) {
+    snprintf(line + n, sizeof(line) - n, " (%.1f%% of the command's)",
+             100 * (tv_sec(&self.ru_utime) + tv_sec(&self.ru_stime)) / cpu);
+  }
+  report_line(line);
+}
+
+/**
+ * Open a --sink. Files are appended to. A FIFO without a reader is waited
+ * for with the block policy; otherwise it's opened read-write so that
+ * writes are buffered in the FIFO until a reader shows up.
+ */
+static int
+sink_open(const char *path, enum sink_policy policy)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK | O_CLOEXEC,
+            0666);
+  if (0 > fd && errno == ENXIO) {
+    if (policy == SINK_BLOCK) {
+      if (0 <= (fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC))) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
       }
-      *emptyline = 1;
-      n-=(q-p+1);
-      p=q+1;
+    } else {
+      fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
     }
-    if (n) {
-      if (*emptyline) {
-	if (0 > safe_write(fdout,pre,strlen(pre))) {
-	goto errout;
-	}
-	*emptyline = 0;
+  }
+  if (0 > fd) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, path, strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+/**
+ * Count newlines in part of a file.
+ *
+ * @return  number of newlines in [from, to) of fd
+ */
+static unsigned long long
+count_lines(int fd, off_t from, off_t to)
+{
+  unsigned long long lines = 0;
+  char buf[65536];
+
+  while (from < to) {
+    size_t want = to - from < (off_t)sizeof(buf) ? (size_t)(to - from)
+      : sizeof(buf);
+    ssize_t n = pread(fd, buf, want, from);
+    const char *p = buf, *q;
+
+    if (0 >= n) {
+      break;
+    }
+    from += n;
+    while ((q = memchr(p, '\n', buf + n - p))) {
+      lines++;
+      p = q + 1;
+    }
+  }
+  return lines;
+}
+
+/**
+ * Open a --log file and its index, path + ".idx". Line numbers carry on
+ * from what's already in the log.
+ */
+static void
+log_open(struct sink *sk)
+{
+  struct idx_entry last;
+  struct stat st;
+  char *idxpath;
+  int rfd;
+
+  sk->fd = sink_open(sk->name, sk->policy);
+  if (fstat(sk->fd, &st)) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, sk->name, strerror(errno));
+    exit(1);
+  }
+  sk->base = st.st_size;
+
+  if (!(idxpath = malloc(strlen(sk->name) + 5))) {
+    fprintf(stderr, "%s: malloc() failed\n", argv0);
+    exit(1);
+  }
+  sprintf(idxpath, "%s.idx", sk->name);
+  if (0 > (sk->idxfd = idx_open(idxpath, 1))) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, idxpath,
+            errno == EINVAL ? "not an ind index" : strerror(errno));
+    exit(1);
+  }
+  free(idxpath);
+
+  /* only the lines since the last entry need counting */
+  if (sk->base) {
+    if (0 > (rfd = open(sk->name, O_RDONLY | O_CLOEXEC))) {
+      fprintf(stderr, "%s: %s: %s\n", argv0, sk->name, strerror(errno));
+      exit(1);
+    }
+    if (idx_last(sk->idxfd, &last) || (off_t)last.offset > sk->base) {
+      last.offset = 0;
+      last.line = 1;
+    }
+    sk->lines = last.line - 1 + count_lines(rfd, last.offset, sk->base);
+    do_close(rfd);
+  }
+}
+
+/**
+ * Turn a --seek-time argument into a time. Either "@<seconds since the
+ * epoch>", "YYYY-MM-DD HH:MM[:SS]" or "HH:MM[:SS]" (local time). Without a
+ * date the first such time after the start of the log is used.
+ *
+ * @param   spec       the argument
+ * @param   first_ns   time of the first line in the log
+ *
+ * @return  ns since the epoch. exit(1)s on parse error.
+ */
+static uint64_t
+parse_seek_time(const char *spec, uint64_t first_ns)
+{
+  static const char *datefmts[] = {
+    "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M:%S",
+    "%Y-%m-%dT%H:%M", NULL
+  };
+  static const char *timefmts[] = { "%H:%M:%S", "%H:%M", NULL };
+  time_t first = first_ns / 1000000000ULL;
+  struct tm tm;
+  const char *end;
+  time_t t;
+  int c;
+
+  if (*spec == '@') {
+    char *e;
+    double secs = strtod(spec + 1, &e);
+    if (*e || e == spec + 1 || secs < 0) {
+      goto bad;
+    }
+    return (uint64_t)(secs * 1e9);
+  }
+  for (c = 0; datefmts[c]; c++) {
+    memset(&tm, 0, sizeof(tm));
+    if ((end = strptime(spec, datefmts[c], &tm)) && !*end) {
+      tm.tm_isdst = -1;
+      return (uint64_t)mktime(&tm) * 1000000000ULL;
+    }
+  }
+  for (c = 0; timefmts[c]; c++) {
+    struct tm hm;
+    memset(&hm, 0, sizeof(hm));
+    if ((end = strptime(spec, timefmts[c], &hm)) && !*end) {
+      localtime_r(&first, &tm);
+      tm.tm_hour = hm.tm_hour;
+      tm.tm_min = hm.tm_min;
+      tm.tm_sec = hm.tm_sec;
+      tm.tm_isdst = -1;
+      t = mktime(&tm);
+      if (t < first) {
+        tm.tm_mday++;
+        tm.tm_isdst = -1;
+        t = mktime(&tm);
       }
-      if (0 > safe_write(fdout,p,n)) {
-	goto errout;
+      return (uint64_t)t * 1000000000ULL;
+    }
+  }
+ bad:
+  fprintf(stderr, "%s: can't parse time \"%s\"\n", argv0, spec);
+  exit(1);
+}
+
+/**
+ * --seek-time: look up a time in a --log file's index and write the log
+ * from there on to stdout.
+ */
+static void
+seek_log(const char *path, const char *spec)
+{
+  struct idx_entry first, e;
+  char *idxpath;
+  char *buf;
+  int idxfd, fd;
+  ssize_t n;
+
+  if (!(idxpath = malloc(strlen(path) + 5))
+      || !(buf = malloc(FORWARD_BULK))) {
+    fprintf(stderr, "%s: malloc() failed\n", argv0);
+    exit(1);
+  }
+  sprintf(idxpath, "%s.idx", path);
+  if (0 > (idxfd = idx_open(idxpath, 0))) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, idxpath,
+            errno == EINVAL ? "not an ind index" : strerror(errno));
+    exit(1);
+  }
+  if (0 > (fd = open(path, O_RDONLY))) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, path, strerror(errno));
+    exit(1);
+  }
+  switch (idx_first(idxfd, &first)) {
+  case 0:
+    break;
+  case 1:
+    /* nothing indexed, so nothing logged */
+    exit(0);
+  default:
+    fprintf(stderr, "%s: %s: %s\n", argv0, idxpath, strerror(errno));
+    exit(1);
+  }
+  if (idx_lookup(idxfd, parse_seek_time(spec, first.time_ns), &e)) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, idxpath, strerror(errno));
+    exit(1);
+  }
+  if (verbose) {
+    fprintf(stderr, "%s: starting at line %llu, offset %llu\n", argv0,
+            (unsigned long long)e.line, (unsigned long long)e.offset);
+  }
+  if ((off_t)e.offset != lseek(fd, e.offset, SEEK_SET)) {
+    fprintf(stderr, "%s: %s: seek: %s\n", argv0, path, strerror(errno));
+    exit(1);
+  }
+  while (0 < (n = read(fd, buf, FORWARD_BULK))) {
+    if (n != safe_write(STDOUT_FILENO, buf, n)) {
+      exit(1);
+    }
+  }
+  if (0 > n) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, path, strerror(errno));
+    exit(1);
+  }
+  exit(0);
+}
+
+/**
+ * --replay: feed a recording through the sinks, as if the command was
+ * running.
+ *
+ * @param   path    recording made with --record
+ * @param   speed   1 for real time, 2 for twice as fast, ... 0 for no delays
+ */
+static void
+replay(const char *path, double speed)
+{
+  struct rec_reader r;
+  struct timespec start;
+  unsigned long long at = 0;
+  unsigned long long delta;
+  const char *p;
+  size_t n;
+  int type;
+  int ret;
+
+  if (rec_reader_open(&r, path)) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, path,
+            errno == EINVAL ? "not an ind recording" : strerror(errno));
+    exit(1);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (1 == (ret = rec_read(&r, &type, &delta, &p, &n))) {
+    at += delta;
+    if (speed > 0 && delta) {
+      unsigned long long due = at / speed;
+      struct timespec now, ts;
+      long long wait;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      wait = due - ((now.tv_sec - start.tv_sec) * 1000000LL
+                    + (now.tv_nsec - start.tv_nsec) / 1000);
+      if (wait > 0) {
+        ts.tv_sec = wait / 1000000;
+        ts.tv_nsec = (wait % 1000000) * 1000;
+        while (nanosleep(&ts, &ts) && errno == EINTR);
       }
     }
+    if (type == REC_STDIN || !n) {
+      continue;
+    }
+    sinks_write(type == REC_STDOUT ? STREAM_STDOUT : STREAM_STDERR, p, n,
+                NULL);
+  }
+  if (0 > ret) {
+    fprintf(stderr, "%s: %s: recording is corrupt\n", argv0, path);
   }
+  sinks_eof(STREAM_STDOUT);
+  sinks_eof(STREAM_STDERR);
+  sinks_drain();
+  trace_finish();
+  exit(0 > ret);
+}
 
- okout:
-  free(pre);
-  free(post);
-  return 0;
+/**
+ * Connect a --syslog sink to a local datagram socket such as /dev/log.
+ */
+static int
+sink_open_dgram(const char *path)
+{
+  struct sockaddr_un sa;
+  int fd;
 
- errout:
-  free(pre);
-  free(post);
-  return 1;
+  if (strlen(path) >= sizeof(sa.sun_path)) {
+    fprintf(stderr, "%s: %s: socket path too long\n", argv0, path);
+    exit(1);
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+
+  if (0 > (fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0))) {
+    fprintf(stderr, "%s: socket(): %s\n", argv0, strerror(errno));
+    exit(1);
+  }
+  if (connect(fd, (struct sockaddr*)&sa, sizeof(sa))) {
+    fprintf(stderr, "%s: %s: %s\n", argv0, path, strerror(errno));
+    exit(1);
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+/**
+ * HOSTNAME, APP-NAME and PROCID fields for syslog records. Nothing to do
+ * (and no uname() to make) without a --syslog sink.
+ */
+static void
+set_syslog_tag(const char *cmd, pid_t pid)
+{
+  char host[256];
+  const char *app;
+  const struct sink *sk;
+
+  for (sk = sinks; sk && !sk->syslog; sk = sk->next);
+  if (!sk) {
+    return;
+  }
+  if (gethostname(host, sizeof(host)) || !*host) {
+    strcpy(host, "-");
+  }
+  host[sizeof(host) - 1] = 0;
+  if ((app = strrchr(cmd, '/'))) {
+    app++;
+  } else {
+    app = cmd;
+  }
+  if (!*app) {
+    app = "-";
+  }
+  /* field lengths are limited by RFC 5424 */
+  snprintf(syslog_tag, sizeof(syslog_tag), "%.255s %.48s %d",
+           host, app, (int)pid);
+}
+
+/**
+ * --line-atomic: release partial lines that have been held for
+ * line_hold_ms, and work out how long select() may sleep until the next
+ * one is due.
+ *
+ * @return  tv, or NULL if nothing is held
+ */
+static struct timeval *
+sinks_hold_timeout(struct timeval *tv)
+{
+  struct sink *sk;
+  struct timespec now;
+  long long wait = -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (sk = sinks; sk; sk = sk->next) {
+    long long held;
+
+    if (sk->fd < 0 || sk->syslog || sk->buflen == sk->complete) {
+      continue;
+    }
+    if (!sk->holding) {
+      sk->holding = 1;
+      sk->held_since = now;
+    }
+    held = (now.tv_sec - sk->held_since.tv_sec) * 1000000LL
+      + (now.tv_nsec - sk->held_since.tv_nsec) / 1000;
+    if (held >= line_hold_ms * 1000) {
+      sink_release(sk);
+      sink_flush(sk);
+      continue;
+    }
+    if (wait < 0 || line_hold_ms * 1000 - held < wait) {
+      wait = line_hold_ms * 1000 - held;
+    }
+  }
+  if (wait < 0) {
+    return NULL;
+  }
+  tv->tv_sec = wait / 1000000;
+  tv->tv_usec = wait % 1000000;
+  return tv;
+}
+
+/**
+ * Copy what's available on stdin to the child. Unless stdin is a
+ * terminal, the data is moved with splice() without passing through
+ * userspace, as much as fits in the pipe at a time.
+ *
+ * @param   fdin:    our stdin
+ * @param   fdout:   the child's stdin, or -1 if it's gone (then input is
+ *                   read and thrown away)
+ * @param   bulk:    stdin is not a terminal
+ *
+ * @return  bytes forwarded, 0 on EOF, -1 on error (already reported),
+ *          FORWARD_EPIPE if the child has closed its stdin
+ */
+static ssize_t
+forward_stdin(int fdin, int fdout, int bulk)
+{
+  static char *buf = NULL;
+  ssize_t n, nw;
+  size_t size = bulk ? FORWARD_BULK : 128;
+
+#ifdef HAVE_SPLICE
+  static int splice_works = 1;
+
+  if (bulk && splice_works && -1 < fdout && !(recorder && record_stdin)) {
+    /* splice() raises SIGPIPE if the child is gone even when stdin is
+     * at EOF, so there may have been nothing to write. */
+    sigset_t pipeset, oldset;
+    int err;
+
+    sigemptyset(&pipeset);
+    sigaddset(&pipeset, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipeset, &oldset);
+    do {
+      n = splice(fdin, NULL, fdout, NULL, FORWARD_BULK, SPLICE_F_MOVE);
+    } while ((-1 == n) && (errno == EINTR));
+    err = errno;
+    if (-1 == n && EPIPE == err) {
+      sigset_t pending;
+      int sig;
+
+      if (!sigpending(&pending) && sigismember(&pending, SIGPIPE)) {
+        sigwait(&pipeset, &sig);
+      }
+    }
+    sigprocmask(SIG_SETMASK, &oldset, NULL);
+    errno = err;
+
+    if (0 <= n) {
+      return n;
+    }
+    if (errno == EPIPE) {
+      return FORWARD_EPIPE;
+    }
+    if (errno != EINVAL && errno != ENOSYS) {
+      fprintf(stderr, "%s: splice(stdin -> child stdin): %d %s\n",
+	      argv0, errno, strerror(errno));
+      return -1;
+    }
+    /* e.g. stdin opened with O_APPEND. Copy instead from now on. */
+    splice_works = 0;
+  }
+#endif
+
+  if (!buf && !(buf = malloc(FORWARD_BULK))) {
+    fprintf(stderr, "%s: Memory alloc of %d bytes failed!\n",
+	    argv0, FORWARD_BULK);
+    return -1;
+  }
+  do {
+    n = read(fdin, buf, size);
+  } while ((-1 == n) && (errno == EINTR));
+  if (0 > n) {
+    fprintf(stderr, "%s: read(stdin_fileno): %d %s\n",
+	    argv0, errno, strerror(errno));
+    return -1;
+  }
+  if (n && record_stdin) {
+    record(REC_STDIN, buf, n);
+  }
+  if (n && -1 < fdout) {
+    nw = safe_write(fdout, buf, n);
+    if (nw != n) {
+      fprintf(stderr, "%s: write(ind -> child stdin, %zd)=>%zd err=%d %s\n",
+	      argv0, n, nw, errno, strerror(errno));
+      return -1;
+    }
+  }
+  return n;
 }
 
 /**
@@ -665,6 +4363,9 @@ fixup_wsp(struct winsize *wsp, const char *prefix, const char *postfix)
   } else {
     wsp->ws_col -= sub;
   }
+  if (status_mode == STATUS_BOTTOM && wsp->ws_row > 1) {
+    wsp->ws_row--;
+  }
 }
 
 /**
@@ -710,10 +4411,61 @@ setup_pty(const char *prefix, const char *postfix,
  *
  */
 static void
-sig_window_resize(int unused)
+sig_window_resize(int unused)
+{
+  unused = unused; /* hide warning */
+  sig_winch_counter++;
+}
+
+/**
+ * SIGCHLD: wake up the main loop. It does the waitpid().
+ */
+static void
+sig_child(int unused)
+{
+  int saved = errno;
+
+  unused = unused; /* hide warning */
+  if (0 > write(sigchld_pipe[1], "", 1)) {
+    /* pipe full, so the main loop will wake up anyway */
+  }
+  errno = saved;
+}
+
+/**
+ * Parse a stdout|stderr|both option argument.
+ *
+ * @return  bitmask of (1 << STREAM_x)
+ */
+static unsigned
+parse_streams(const char *arg)
+{
+  if (!strcmp(arg, "stdout")) {
+    return 1 << STREAM_STDOUT;
+  } else if (!strcmp(arg, "stderr")) {
+    return 1 << STREAM_STDERR;
+  } else if (!strcmp(arg, "both")) {
+    return (1 << STREAM_STDOUT) | (1 << STREAM_STDERR);
+  }
+  fprintf(stderr, "%s: unknown streams \"%s\" (stdout, stderr or both)\n",
+          argv0, arg);
+  exit(1);
+}
+
+/**
+ * --wrap: (re)read the width of the terminal(s) we write to.
+ */
+static void
+wrap_resize(void)
 {
-  unused = unused; /* hide warning */
-  sig_winch_counter++;
+  struct sink *sk;
+  struct winsize ws;
+
+  for (sk = sinks; sk; sk = sk->next) {
+    if (sk->blocking && !sk->json && 0 <= sk->fd) {
+      sk->cols = !ioctl(sk->fd, TIOCGWINSZ, &ws) ? ws.ws_col : 0;
+    }
+  }
 }
 
 /**
@@ -736,6 +4488,24 @@ update_window_size(int dst, int src, const char *prefix, const char *postfix)
   }
 }
 
+/**
+ * Give the command's terminal(s) the size of ours, minus the prefixes and
+ * postfixes, including those of any nested inds.
+ */
+static void
+update_window_sizes(int in, int out, const char *prefix, const char *postfix)
+{
+  nest_compose(&prefix, &postfix);
+  if (0 <= in) {
+    update_window_size(in, STDIN_FILENO, prefix, postfix);
+  }
+  if (0 <= out) {
+    update_window_size(out, STDOUT_FILENO, prefix, postfix);
+  }
+  free((char*)prefix);
+  free((char*)postfix);
+}
+
 /**
  *
  */
@@ -747,14 +4517,32 @@ main(int argc, char **argv)
   int ptym_out = -1, ptys_out = -1;
   int child_stdin, child_stdout, child_stderr;
   int ind_stdin, ind_stdout, ind_stderr;
-  char *prefix = "  ";
-  char *eprefix = ">>";
-  char *postfix = "";
-  char *epostfix = "";
-  int emptyline = 1;
-  int eemptyline = 1;
+  const char *prefix = "  ";
+  const char *postfix = "";
+  const char *eprefix = ">>";
+  const char *epostfix = "";
+  struct sink *term_out, *term_err;
+  struct sink *sk;
+  int fanout = 0;
+  const char *record_file = NULL;
+  const char *trace_file = NULL;
+  const char *metrics_socket = NULL;
+  const char *replay_file = NULL;
+  const char *seek_time = NULL;
+  int screen_mode = 0;
+  int nestable = 1;
+  int nest_child = -1;
+  double speed = 1;
   int childpid;
+  int child_status = 0;
+  int child_exited = 0;
+  struct rusage child_rusage;
+  struct perf_counters perf;
+  struct timespec child_start_time;
+  struct timespec child_exit_time;
   int stdin_fileno = STDIN_FILENO;
+  int stdin_tty, stdout_tty;
+  int ind_stdin_tty, ind_stdout_tty;
 
   argv0 = argv[0];
   if (argv[argc]) {
@@ -767,78 +4555,445 @@ main(int argc, char **argv)
     return 1;
   }
 
-  { /* handle GNU options */
-    int c;
-    for (c = 1; c < argc; c++) {
-      
-      if (!strcmp(argv[c], "--")) {
-        break;
-      } else if (!strcmp(argv[c], "--help")) {
+  /* the terminal (or whatever we were started with) */
+  term_out = sink_new("stdout", STDOUT_FILENO, 1 << STREAM_STDOUT, 1);
+  term_err = sink_new("stderr", STDERR_FILENO, 1 << STREAM_STDERR, 1);
+
+  {
+    struct sink *cur = NULL;
+    static const struct option longopts[] = {
+      { "help",    no_argument, NULL, 'h' },
+      { "version", no_argument, NULL, OPT_VERSION },
+      { "copying", no_argument, NULL, OPT_COPYING },
+      { "json",    no_argument, NULL, OPT_JSON },
+      { "inject",  no_argument, NULL, OPT_INJECT },
+      { "line-atomic", no_argument,     NULL, OPT_LINE_ATOMIC },
+      { "line-hold", required_argument, NULL, OPT_LINE_HOLD },
+      { "line-max",  required_argument, NULL, OPT_LINE_MAX },
+      { "record",    required_argument, NULL, OPT_RECORD },
+      { "record-stdin", no_argument,    NULL, OPT_RECORD_STDIN },
+      { "replay",    required_argument, NULL, OPT_REPLAY },
+      { "speed",     required_argument, NULL, OPT_SPEED },
+      { "sink",          required_argument, NULL, OPT_SINK },
+      { "syslog",        required_argument, NULL, OPT_SYSLOG },
+      { "sink-policy",   required_argument, NULL, OPT_SINK_POLICY },
+      { "sink-buffer",   required_argument, NULL, OPT_SINK_BUFFER },
+      { "sink-streams",  required_argument, NULL, OPT_SINK_STREAMS },
+      { "sink-json",     no_argument,       NULL, OPT_SINK_JSON },
+      { "sink-prefix",   required_argument, NULL, OPT_SINK_PREFIX },
+      { "sink-postfix",  required_argument, NULL, OPT_SINK_POSTFIX },
+      { "sink-eprefix",  required_argument, NULL, OPT_SINK_EPREFIX },
+      { "sink-epostfix", required_argument, NULL, OPT_SINK_EPOSTFIX },
+      { "sink-strip",    required_argument, NULL, OPT_SINK_STRIP },
+      { "log",           required_argument, NULL, OPT_LOG },
+      { "index-lines",   required_argument, NULL, OPT_INDEX_LINES },
+      { "index-ms",      required_argument, NULL, OPT_INDEX_MS },
+      { "seek-time",     required_argument, NULL, OPT_SEEK_TIME },
+      { "screen",        no_argument,       NULL, OPT_SCREEN },
+      { "strip",         required_argument, NULL, OPT_STRIP },
+      { "wrap",          no_argument,       NULL, OPT_WRAP },
+      { "wrap-marker",   required_argument, NULL, OPT_WRAP_MARKER },
+      { "priority",      required_argument, NULL, OPT_PRIORITY },
+      { "read-budget",   required_argument, NULL, OPT_READ_BUDGET },
+      { "drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT },
+      { "trace-file",    required_argument, NULL, OPT_TRACE_FILE },
+      { "metrics-file",  required_argument, NULL, OPT_METRICS_FILE },
+      { "metrics-socket", required_argument, NULL, OPT_METRICS_SOCKET },
+      { "metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL },
+      { "status",        no_argument,       NULL, OPT_STATUS },
+      { "rusage",        no_argument,       NULL, OPT_RUSAGE },
+      { "perf-counters", no_argument,       NULL, OPT_PERF_COUNTERS },
+      { "gap-report",    required_argument, NULL, OPT_GAP_REPORT },
+      { "nest",          no_argument,       NULL, OPT_NEST },
+      { NULL, 0, NULL, 0 }
+    };
+
+    while (-1 != (c = getopt_long(argc, argv, "+hp:a:P:A:v",
+                                  longopts, NULL))) {
+      /* a nested ind can only hand over prefixes and postfixes */
+      if (c != 'p' && c != 'a' && c != 'P' && c != 'A' && c != OPT_NEST) {
+        nestable = 0;
+      }
+      if (c >= OPT_SINK_POLICY && c <= OPT_INDEX_MS && !cur) {
+        fprintf(stderr, "%s: sink options must come after a --sink or --syslog\n", argv0);
+        exit(1);
+      }
+      switch(c) {
+      case 'h':
         usage(0);
-      } else if (!strcmp(argv[c], "--version")) {
+      case OPT_VERSION:
         printVersion();
-      } else if (!strcmp(argv[c], "--copying")) {
+      case OPT_COPYING:
         printLicense();
+      case OPT_JSON:
+        json_output = 1;
+        break;
+      case OPT_INJECT:
+        inject = 1;
+        break;
+      case OPT_NEST:
+        nest_opt = 1;
+        break;
+      case OPT_LINE_ATOMIC:
+        line_atomic = 1;
+        break;
+      case OPT_RECORD:
+        record_file = optarg;
+        break;
+      case OPT_TRACE_FILE:
+        trace_file = optarg;
+        break;
+      case OPT_METRICS_FILE:
+        metrics_file = optarg;
+        extra_stats = 1;
+        break;
+      case OPT_METRICS_SOCKET:
+        metrics_socket = optarg;
+        extra_stats = 1;
+        break;
+      case OPT_RUSAGE:
+        rusage_report = 1;
+        break;
+      case OPT_PERF_COUNTERS:
+        perf_report_on = 1;
+        break;
+      case OPT_STATUS:
+        /* the bottom row if there's a terminal to put it on */
+        if (isatty(STDOUT_FILENO)) {
+          status_mode = STATUS_BOTTOM;
+        } else if (isatty(STDERR_FILENO)) {
+          status_mode = STATUS_STDERR;
+        }
+        extra_stats = 1;
+        break;
+      case OPT_METRICS_INTERVAL: {
+        char *end;
+        metrics_interval_ms = strtol(optarg, &end, 10);
+        if (*end || metrics_interval_ms <= 0) {
+          fprintf(stderr, "%s: bad metrics interval \"%s\"\n", argv0,
+                  optarg);
+          exit(1);
+        }
+        break;
+      }
+      case OPT_RECORD_STDIN:
+        record_stdin = 1;
+        break;
+      case OPT_REPLAY:
+        replay_file = optarg;
+        break;
+      case OPT_SPEED: {
+        char *end;
+        speed = strtod(optarg, &end);
+        if (*end || speed < 0) {
+          fprintf(stderr, "%s: bad speed \"%s\"\n", argv0, optarg);
+          exit(1);
+        }
+        break;
+      }
+      case OPT_LINE_HOLD:
+      case OPT_LINE_MAX: {
+        char *end;
+        unsigned long v = strtoul(optarg, &end, 10);
+        if (*end || !v) {
+          fprintf(stderr, "%s: bad %s \"%s\"\n", argv0,
+                  c == OPT_LINE_HOLD ? "hold time" : "line size", optarg);
+          exit(1);
+        }
+        if (c == OPT_LINE_HOLD) {
+          line_hold_ms = v;
+        } else {
+          line_max = v;
+        }
+        line_atomic = 1;
+        break;
+      }
+      case OPT_SINK:
+        cur = sink_new(optarg, -1, (1 << STREAM_STDOUT) | (1 << STREAM_STDERR),
+                       0);
+        fanout = 1;
+        break;
+      case OPT_SYSLOG:
+        cur = sink_new(optarg, -1, (1 << STREAM_STDOUT) | (1 << STREAM_STDERR),
+                       0);
+        cur->syslog = 1;
+        fanout = 1;
+        break;
+      case OPT_LOG:
+        cur = sink_new(optarg, -1, (1 << STREAM_STDOUT) | (1 << STREAM_STDERR),
+                       0);
+        cur->index_lines = 1000;
+        cur->index_ms = 1000;
+        fanout = 1;
+        break;
+      case OPT_INDEX_LINES:
+      case OPT_INDEX_MS: {
+        char *end;
+        unsigned long v = strtoul(optarg, &end, 10);
+        if (*end || !v || !cur->index_lines) {
+          fprintf(stderr, "%s: bad index interval \"%s\"%s\n", argv0, optarg,
+                  cur->index_lines ? "" : " (only for --log)");
+          exit(1);
+        }
+        if (c == OPT_INDEX_LINES) {
+          cur->index_lines = v;
+        } else {
+          cur->index_ms = v;
+        }
+        break;
+      }
+      case OPT_SEEK_TIME:
+        seek_time = optarg;
+        break;
+      case OPT_SCREEN:
+        screen_mode = 1;
+        break;
+      case OPT_SINK_POLICY:
+        if (!strcmp(optarg, "block")) {
+          cur->policy = SINK_BLOCK;
+        } else if (!strcmp(optarg, "drop")) {
+          cur->policy = SINK_DROP;
+        } else if (!strcmp(optarg, "disconnect")) {
+          cur->policy = SINK_DISCONNECT;
+        } else {
+          fprintf(stderr, "%s: unknown sink policy \"%s\"\n", argv0, optarg);
+          exit(1);
+        }
+        break;
+      case OPT_SINK_BUFFER: {
+        char *end;
+        unsigned long v = strtoul(optarg, &end, 10);
+        if (*end || !v) {
+          fprintf(stderr, "%s: bad sink buffer size \"%s\"\n", argv0, optarg);
+          exit(1);
+        }
+        cur->bufmax = v;
+        break;
+      }
+      case OPT_SINK_STREAMS:
+        cur->streams = parse_streams(optarg);
+        break;
+      case OPT_SINK_STRIP:
+        cur->strip = parse_streams(optarg);
+        break;
+      case OPT_STRIP:
+        term_out->strip = term_err->strip = parse_streams(optarg);
+        break;
+      case OPT_WRAP_MARKER:
+        wrap_marker = optarg;
+        /* fall through */
+      case OPT_WRAP:
+        wrap = 1;
+        break;
+      case OPT_PRIORITY:
+        if (!strcmp(optarg, "stdout")) {
+          read_first = STREAM_STDOUT;
+        } else if (!strcmp(optarg, "stderr")) {
+          read_first = STREAM_STDERR;
+        } else if (!strcmp(optarg, "none")) {
+          read_first = -1;
+        } else {
+          fprintf(stderr, "%s: unknown priority \"%s\" (stdout, stderr or none)\n",
+                  argv0, optarg);
+          exit(1);
+        }
+        break;
+      case OPT_GAP_REPORT: {
+        char *end;
+        unsigned long v = strtoul(optarg, &end, 10);
+        if (*end || !v || v > 1000000) {
+          fprintf(stderr, "%s: bad gap report size \"%s\"\n", argv0,
+                  optarg);
+          exit(1);
+        }
+        gap_max = v;
+        if (!(gaps = realloc(gaps, gap_max * sizeof(struct gap)))) {
+          fprintf(stderr, "%s: realloc(): %s\n", argv0, strerror(errno));
+          exit(1);
+        }
+        break;
+      }
+      case OPT_READ_BUDGET: {
+        char *end;
+        unsigned long v = strtoul(optarg, &end, 10);
+        if (*end || !v) {
+          fprintf(stderr, "%s: bad read budget \"%s\"\n", argv0, optarg);
+          exit(1);
+        }
+        read_budget = v;
+        break;
+      }
+      case OPT_DRAIN_TIMEOUT: {
+        char *end;
+        drain_timeout_ms = strtol(optarg, &end, 10);
+        if (*end || drain_timeout_ms < 0) {
+          fprintf(stderr, "%s: bad drain timeout \"%s\"\n", argv0, optarg);
+          exit(1);
+        }
+        break;
+      }
+      case OPT_SINK_JSON:
+        cur->json = 1;
+        break;
+      case OPT_SINK_PREFIX:
+        cur->prefix[STREAM_STDOUT] = optarg;
+        break;
+      case OPT_SINK_POSTFIX:
+        cur->postfix[STREAM_STDOUT] = optarg;
+        break;
+      case OPT_SINK_EPREFIX:
+        cur->prefix[STREAM_STDERR] = optarg;
+        break;
+      case OPT_SINK_EPOSTFIX:
+        cur->postfix[STREAM_STDERR] = optarg;
+        break;
+      case 'p':
+        prefix = optarg;
+        break;
+      case 'a':
+        postfix = optarg;
+        break;
+      case 'P':
+        eprefix = optarg;
+        break;
+      case 'A':
+        epostfix = optarg;
+        break;
+      case 'v':
+        verbose++;
+        break;
+      default:
+        usage(1);
       }
     }
   }
-  
-  while (-1 != (c = getopt(argc, argv, "+hp:a:P:A:v"))) {
-    switch(c) {
-    case 'h':
-      usage(0);
-    case 'p':
-      prefix = optarg;
-      break;
-    case 'a':
-      postfix = optarg;
-      break;
-    case 'P':
-      eprefix = optarg;
-      break;
-    case 'A':
-      epostfix = optarg;
-      break;
-    case 'v':
-      verbose++;
-      break;
-    default:
+
+  if (optind >= argc && !replay_file) {
+    usage(1);
+  }
+
+  if (seek_time) {
+    if (optind + 1 != argc) {
       usage(1);
     }
+    seek_log(argv[optind], seek_time);
   }
 
-  if (optind >= argc) {
-    usage(1);
+  /* JSON records carry the stream name instead of any prefix, and both
+   * streams go to stdout so they end up in the same record stream. */
+  if (json_output) {
+    term_out->streams |= 1 << STREAM_STDERR;
+    term_out->json = 1;
+    term_err->streams = 0;
   }
 
-  { /* bail on format errors */
-    char *tmp;
-    format(prefix, &tmp, 1);
-    free(tmp);
-    format(postfix, &tmp, 1);
-    free(tmp);
-    format(eprefix, &tmp, 1);
-    free(tmp);
-    format(epostfix, &tmp, 1);
-    free(tmp);
+  if (wrap) {
+    wrap_resize();
+  }
+
+  /* sink templates default to the global ones */
+  for (sk = sinks; sk; sk = sk->next) {
+    if (!sk->prefix[STREAM_STDOUT]) {
+      sk->prefix[STREAM_STDOUT] = prefix;
+    }
+    if (!sk->postfix[STREAM_STDOUT]) {
+      sk->postfix[STREAM_STDOUT] = postfix;
+    }
+    if (!sk->prefix[STREAM_STDERR]) {
+      sk->prefix[STREAM_STDERR] = eprefix;
+    }
+    if (!sk->postfix[STREAM_STDERR]) {
+      sk->postfix[STREAM_STDERR] = epostfix;
+    }
+  }
+
+  /* expand the templates, bailing on format errors */
+  for (sk = sinks; sk; sk = sk->next) {
+    int c;
+
+    if (sk->json || sk->syslog) {
+      continue;
+    }
+    for (c = 0; c < NSTREAMS; c++) {
+      sink_templates(sk, c, 1);
+      proc_vars |= format_uses_vars(sk->prefix[c])
+        || format_uses_vars(sk->postfix[c]);
+    }
+  }
+  if (wrap_marker) {
+    template_init(&wrap_template, wrap_marker, 1);
+  }
+
+  if (record_file) {
+    if (!(recorder = malloc(sizeof(struct rec_writer)))
+        || rec_writer_open(recorder, record_file)) {
+      fprintf(stderr, "%s: %s: %s\n", argv0, record_file, strerror(errno));
+      exit(1);
+    }
+  }
+
+  if (metrics_socket) {
+    metrics_sock = metrics_listen(metrics_socket);
+  }
+
+  if (trace_file) {
+    if (!(tracer = malloc(sizeof(struct tracer)))
+        || trace_open(tracer, trace_file)) {
+      fprintf(stderr, "%s: %s: %s\n", argv0, trace_file, strerror(errno));
+      exit(1);
+    }
+  }
+
+  try_nest(&argv[optind], prefix, postfix, eprefix, epostfix,
+           nestable && !replay_file && !seek_time);
+
+  if (inject && !replay_file) {
+#ifdef IND_INJECT_LIB
+    try_inject(&argv[optind], prefix, postfix, eprefix, epostfix,
+               screen_mode);
+#else
+    if (verbose) {
+      fprintf(stderr, "%s: --inject not supported on this system\n", argv0);
+    }
+#endif
+  }
+
+  /* open the extra sinks only now, so nothing is created on bad usage */
+  for (sk = sinks; sk; sk = sk->next) {
+    if (sk->syslog) {
+      sk->fd = sink_open_dgram(sk->name);
+    } else if (sk->index_lines) {
+      log_open(sk);
+    } else if (!sk->blocking) {
+      sk->fd = sink_open(sk->name, sk->policy);
+    }
+  }
+
+  if (replay_file) {
+    set_syslog_tag(argv0, getpid());
+    replay(replay_file, speed);
   }
 
+  /* none of these change while we run, so only ask once */
+  stdin_tty = isatty(STDIN_FILENO);
+  stdout_tty = isatty(STDOUT_FILENO);
+
   /* create communication pipes (stderr is always in a pipe) */
   {
     int pip_stdin[2];
     int pip_stdout[2];
 
-    if (isatty(STDIN_FILENO)) {
+    if (stdin_tty) {
       setup_pty(prefix, postfix, STDIN_FILENO, &ptym_in, &ptys_in);
     }
     
     /* only allocate a new pty if stdout is not the same terminal as stdin */
-    if (isatty(STDOUT_FILENO)) {
+    if (stdout_tty) {
       if (0 <= ptym_in) {
-	char *ttyin, *ttyout;
-	ttyin = strdup(ttyname(STDIN_FILENO));
-	ttyout = strdup(ttyname(STDOUT_FILENO));
-	if (!strcmp(ttyin, ttyout)) {
+	struct stat stin, stout;
+	if (!fstat(STDIN_FILENO, &stin)
+	    && !fstat(STDOUT_FILENO, &stout)
+	    && stin.st_rdev == stout.st_rdev) {
 	  ptym_out = ptym_in;
 	  ptys_out = ptys_in;
 	}
@@ -848,7 +5003,7 @@ main(int argc, char **argv)
       }
     }
 
-    if (isatty(STDIN_FILENO)) {
+    if (stdin_tty) {
       child_stdin = ptys_in;
       ind_stdin = ptym_in;
     } else {
@@ -860,7 +5015,7 @@ main(int argc, char **argv)
       ind_stdin = pip_stdin[1];
     }
 
-    if (isatty(STDOUT_FILENO)) {
+    if (stdout_tty) {
       child_stdout = ptys_out;
       ind_stdout = ptym_out;
     } else {
@@ -881,6 +5036,26 @@ main(int argc, char **argv)
     print_ttyname("stdout", ptym_out, ptys_out);
   }
 
+  /* --screen draws the pty's contents itself, so it needs one */
+  if (screen_mode) {
+    struct winsize ws;
+
+    if (0 > ptym_out || json_output) {
+      if (verbose) {
+        fprintf(stderr, "%s: --screen needs stdout to be a terminal"
+                " and no --json\n", argv0);
+      }
+    } else if (0 > ioctl(ptym_out, TIOCGWINSZ, &ws)) {
+      fprintf(stderr, "%s: ioctl(TIOCGWINSZ): %s\n", argv0, strerror(errno));
+      exit(1);
+    } else {
+      screen = screen_new(ws.ws_row, ws.ws_col);
+      screen_prefix = prefix;
+      term_out->streams = 0;
+      term_err->streams = 0;
+    }
+  }
+
   /* create stderr pipe */
   {
     int es[2];
@@ -892,15 +5067,83 @@ main(int argc, char **argv)
     ind_stderr = es[0];
   }
 
+  ind_stdin_tty = isatty(ind_stdin);
+  ind_stdout_tty = isatty(ind_stdout);
+
+  nest_child = nest_listen(argv[optind], child_stdout, child_stderr);
+
+  /* the counters must be open before the command starts, so it waits on
+   * this pipe, and that takes fork() */
+  if (perf_report_on && 0 > pipe(perf_sync)) {
+    fprintf(stderr, "%s: pipe() failed: %s\n", argv[0], strerror(errno));
+    exit(1);
+  }
+
+#ifdef IND_USE_SPAWN
+  if (0 > ptym_in && 0 > ptym_out && !perf_report_on) {
+    int ind[3];
+    ind[0] = ind_stdin;
+    ind[1] = ind_stdout;
+    ind[2] = ind_stderr;
+    childpid = spawn_child(child_stdin, child_stdout, child_stderr, ind,
+                           &argv[optind]);
+  } else
+#endif
   switch ((childpid = fork())) {
   case 0:
     do_close3(ind_stdin, ind_stdout, ind_stderr);
+    do_close(perf_sync[1]);
     child(child_stdin, child_stdout, child_stderr, &argv[optind]);
   case -1:
     fprintf(stderr, "%s: fork() failed: %s\n", argv[0], strerror(errno));
     exit(1);
   }
+  clock_gettime(CLOCK_MONOTONIC, &child_start_time);
+  gap_epoch = trace_now();
   do_close3(child_stdin, child_stdout, child_stderr);
+  if (perf_report_on) {
+    if (0 >= perf_open(&perf, childpid)) {
+      fprintf(stderr, "%s: --perf-counters: no counters available: %s\n",
+              argv[0], strerror(errno));
+      perf_report_on = 0;
+    }
+    do_close(perf_sync[0]);
+    if (1 != write(perf_sync[1], "", 1)) {
+      fprintf(stderr, "%s: write(perf sync pipe): %s\n", argv[0],
+              strerror(errno));
+    }
+    do_close(perf_sync[1]);
+  }
+  do_close(nest_child);
+
+  /* the main loop finds out about the child exiting through a pipe. One
+   * byte in it up front, in case it exited before the handler was set. */
+#ifdef HAVE_PIPE2
+  if (0 > pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK)) {
+    fprintf(stderr, "%s: pipe2() failed: %s\n", argv[0], strerror(errno));
+    exit(1);
+  }
+#else
+  if (0 > pipe(sigchld_pipe)) {
+    fprintf(stderr, "%s: pipe() failed: %s\n", argv[0], strerror(errno));
+    exit(1);
+  }
+  for (c = 0; c < 2; c++) {
+    fcntl(sigchld_pipe[c], F_SETFD, FD_CLOEXEC);
+    fcntl(sigchld_pipe[c], F_SETFL,
+          fcntl(sigchld_pipe[c], F_GETFL) | O_NONBLOCK);
+  }
+#endif
+  signal(SIGCHLD, sig_child);
+  sig_child(SIGCHLD);
+
+  set_syslog_tag(argv[optind], childpid);
+
+  /* a sink going away must not take us with it. Only after the child is
+   * started, since ignored signals are inherited. */
+  if (fanout || 0 <= metrics_sock) {
+    signal(SIGPIPE, SIG_IGN);
+  }
 
   if (verbose > 1) {
     fprintf(stderr, "%s: childpid: %d\n", argv[0], childpid);
@@ -909,45 +5152,50 @@ main(int argc, char **argv)
     terminfo(2);
   }
   /* Raw stdin */
-  if (tcgetattr(stdin_fileno, &orig_stdin_tio)) {
+  if (!stdin_tty || tcgetattr(stdin_fileno, &orig_stdin_tio)) {
     /* if we can't get stdin attrs, don't even try to set them */
   } else {
     struct termios tio;
 
     orig_stdin_tio_ok = 1;
 
-    if (!tcgetattr(stdin_fileno, &tio)) {
-      tio.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|IXON);
-      if (isatty(STDOUT_FILENO)) {
-	tio.c_lflag &= ~(ECHO|ECHONL);
-	tio.c_iflag &= ~(INLCR|IGNCR|ICRNL);
-	tio.c_lflag &= ~(ICANON);
-      }
-      tio.c_lflag &= ~(ISIG|IEXTEN);
+    memcpy(&tio, &orig_stdin_tio, sizeof(tio));
+    tio.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|IXON);
+    if (stdout_tty) {
+      tio.c_lflag &= ~(ECHO|ECHONL);
+      tio.c_iflag &= ~(INLCR|IGNCR|ICRNL);
+      tio.c_lflag &= ~(ICANON);
+    }
+    tio.c_lflag &= ~(ISIG|IEXTEN);
 
-      /* change to 8bit? */
-      if (0) {
-	tio.c_cflag &= ~(CSIZE | PARENB);
-	tio.c_cflag |= CS8;
-      }
+    /* change to 8bit? */
+    if (0) {
+      tio.c_cflag &= ~(CSIZE | PARENB);
+      tio.c_cflag |= CS8;
+    }
 
-      tio.c_cc[VMIN]  = 1;
-      tio.c_cc[VTIME] = 0;
-      
-      if (tcsetattr(stdin_fileno, TCSADRAIN, &tio)) {
-	fprintf(stderr, "%s: tcsetattr(stdin, ) failed: %s\n",
-		argv[0], strerror(errno));
-	exit(1);
-      }
+    tio.c_cc[VMIN]  = 1;
+    tio.c_cc[VTIME] = 0;
+
+    if (tcsetattr(stdin_fileno, TCSADRAIN, &tio)) {
+      fprintf(stderr, "%s: tcsetattr(stdin, ) failed: %s\n",
+	      argv[0], strerror(errno));
+      exit(1);
     }
   }
 
   signal(SIGWINCH, sig_window_resize);
   signal(SIGCONT, sig_window_resize);
 
+  if (status_mode) {
+    status_begin(term_out, term_err);
+  }
+
   /* main loop */
   for(;;) {
     fd_set fds;
+    fd_set wfds;
+    struct timeval tv, *tvp = NULL;
     int n;
     int fdmax;
 
@@ -956,7 +5204,7 @@ main(int argc, char **argv)
     /*
      * done when both channels to/from child are closed
      */
-    if (isatty(stdin_fileno)) {
+    if (stdin_tty) {
       if (ind_stdin == -1
 	  && ind_stdout == -1
 	  && ind_stderr == -1) {
@@ -971,11 +5219,36 @@ main(int argc, char **argv)
       }
     }
 
+    if (child_exited && ind_stdout == -1 && ind_stderr == -1) {
+      break;
+    }
+
     FD_ZERO(&fds);
     do_fdset(&fds, ind_stdout, &fdmax);
     do_fdset(&fds, ind_stderr, &fdmax);
     do_fdset(&fds, stdin_fileno, &fdmax);
-    do_fdset(&fds, ind_stdin, &fdmax);
+    if (ind_stdin_tty) {
+      /* a pipe's write end only turns readable when the child closes
+       * it, and then it stays so. forward_stdin() finds out anyway. */
+      do_fdset(&fds, ind_stdin, &fdmax);
+    }
+    do_fdset(&fds, nest_fd, &fdmax);
+    do_fdset(&fds, sigchld_pipe[0], &fdmax);
+    do_fdset(&fds, metrics_sock, &fdmax);
+    {
+      const struct nest_layer *l;
+      for (l = nest_layers; l; l = l->next) {
+        do_fdset(&fds, l->fd, &fdmax);
+      }
+    }
+
+    /* non-blocking sinks that are behind */
+    FD_ZERO(&wfds);
+    for (sk = sinks; sk; sk = sk->next) {
+      if (!sk->blocking && sink_pending(sk)) {
+        do_fdset(&wfds, sk->fd, &fdmax);
+      }
+    }
 
     if (verbose > 1) {
       fprintf(stderr, "%s: select(%d %d %d %d)\n", argv0,
@@ -994,13 +5267,80 @@ main(int argc, char **argv)
        *       catch it until the next iteration.
        */
       if (sigwinchcount != last_sigwinchcount) {
-        update_window_size(ind_stdin, STDIN_FILENO, prefix, postfix);
-        update_window_size(ind_stdout, STDOUT_FILENO, prefix, postfix);
+        long long t0 = tracer ? trace_now() : 0;
+
+        if (IND_PROBE_ENABLED(resize)) {
+          struct winsize ws;
+          if (!ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws)) {
+            IND_PROBE2(resize, ws.ws_row, ws.ws_col);
+          }
+        }
+        update_window_sizes(ind_stdin, ind_stdout, prefix, postfix);
         last_sigwinchcount = sigwinchcount;
+        if (wrap) {
+          wrap_resize();
+        }
+        if (screen) {
+          struct winsize ws;
+          if (!ioctl(ind_stdout, TIOCGWINSZ, &ws)) {
+            screen_resize(screen, ws.ws_row, ws.ws_col);
+          }
+        }
+        if (status_mode) {
+          status_region();
+          status_draw();
+        }
+        if (tracer) {
+          trace_add(tracer, "resize", -1, t0);
+        }
       }
     }
     
-    n = select(fdmax + 1, &fds, NULL, NULL, NULL);
+    if (line_atomic) {
+      tvp = sinks_hold_timeout(&tv);
+    }
+    if (screen) {
+      tvp = screen_update(&tv, tvp, 0);
+    }
+    if (metrics_file) {
+      tvp = metrics_update(&tv, tvp, child_exited ? child_status : -1);
+    }
+    if (status_mode) {
+      tvp = status_update(&tv, tvp);
+    }
+    if (proc_vars && !child_exited) {
+      tvp = proc_update(childpid, &tv, tvp);
+    }
+    if (child_exited && drain_timeout_ms >= 0) {
+      struct timespec now;
+      long long left;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      left = drain_timeout_ms * 1000LL
+        - ((now.tv_sec - child_exit_time.tv_sec) * 1000000LL
+           + (now.tv_nsec - child_exit_time.tv_nsec) / 1000);
+      if (left <= 0) {
+        if (verbose) {
+          fprintf(stderr, "%s: command exited %ld ms ago, not waiting "
+                  "for the rest of its output\n", argv0, drain_timeout_ms);
+        }
+        break;
+      }
+      if (!tvp || tvp->tv_sec * 1000000LL + tvp->tv_usec > left) {
+        tv.tv_sec = left / 1000000;
+        tv.tv_usec = left % 1000000;
+        tvp = &tv;
+      }
+    }
+    {
+      long long t0 = tracer ? trace_now() : 0;
+
+      n = select(fdmax + 1, &fds, &wfds, NULL, tvp);
+      if (tracer) {
+        trace_add(tracer, "select", -1, t0);
+      }
+    }
+    IND_PROBE1(wakeup, n);
 
     if (0 > n) {
       switch (errno) {
@@ -1015,9 +5355,15 @@ main(int argc, char **argv)
 
     if (verbose > 1) {
       fprintf(stderr, "%s: select(): %d\n", argv0, n);
+      for (sk = sinks; sk; sk = sk->next) {
+        if (0 <= sk->fd && FD_ISSET(sk->fd, &wfds)) {
+          fprintf(stderr, "%s: \tfd: sink %s (%d) writable\n",
+                  argv0, sk->name, sk->fd);
+        }
+      }
       if (ind_stdin != -1 && FD_ISSET(ind_stdin, &fds)) {
 	fprintf(stderr,"%s: \tfd: ind_stdin (%d) %d readable\n",
-		argv0,ind_stdin, isatty(ind_stdin));
+		argv0,ind_stdin, ind_stdin_tty);
       }
       if (ind_stdout != -1 && FD_ISSET(ind_stdout, &fds)) {
 	fprintf(stderr,"%s: \tfd: ind_stdout (%d) readable\n",
@@ -1033,22 +5379,89 @@ main(int argc, char **argv)
       }
     }
 
+    /* the command has exited. Whatever it left running may keep its
+     * stdout and stderr open, so from now on only --drain-timeout long. */
+    if (FD_ISSET(sigchld_pipe[0], &fds)) {
+      char buf[64];
+      int status;
+
+      while (0 < read(sigchld_pipe[0], buf, sizeof(buf)));
+      if (!child_exited
+          && childpid == wait_child(childpid, &status, WNOHANG,
+                                    &child_rusage)) {
+        if (verbose > 1) {
+          fprintf(stderr, "%s: child exited: %d\n", argv0, status);
+        }
+        IND_PROBE2(exit, childpid, status);
+        child_exited = 1;
+        child_status = status;
+        clock_gettime(CLOCK_MONOTONIC, &child_exit_time);
+        /* nobody left to read stdin */
+        stdin_fileno = -1;
+        if (ind_stdin != ind_stdout) {
+          do_close(ind_stdin);
+          ind_stdin = -1;
+        }
+      }
+    }
+
+    if (0 <= metrics_sock && FD_ISSET(metrics_sock, &fds)) {
+      metrics_serve(child_exited ? child_status : -1);
+    }
+
+    /* while the command is busy, let sinks fill up a batch */
+    {
+      int busy = (-1 < ind_stdout && FD_ISSET(ind_stdout, &fds))
+        || (-1 < ind_stderr && FD_ISSET(ind_stderr, &fds));
+      for (sk = sinks; sk; sk = sk->next) {
+        if (!sk->blocking && 0 <= sk->fd && FD_ISSET(sk->fd, &wfds)
+            && (!busy || sink_batch_full(sk))) {
+          sink_flush(sk);
+        }
+      }
+    }
+
+    /* a nested ind joining or finishing. What was written before that
+     * gets the prefixes from before. */
+    if (nest_pending(&fds)) {
+      int c;
+
+      for (c = 0; c < NEST_DRAIN_READS && -1 < ind_stdout
+             && fd_readable(ind_stdout); c++) {
+        if (process(ind_stdout, STREAM_STDOUT, NULL)) {
+          if (ind_stdin == ind_stdout) {
+            ind_stdin = -1;
+          }
+          ind_stdout = -1;
+        }
+      }
+      for (c = 0; c < NEST_DRAIN_READS && -1 < ind_stderr
+             && fd_readable(ind_stderr); c++) {
+        if (process(ind_stderr, STREAM_STDERR, NULL)) {
+          ind_stderr = -1;
+        }
+      }
+      nest_update(&fds);
+      update_window_sizes(ind_stdin, ind_stdout, prefix, postfix);
+      continue;
+    }
+
     if (ind_stdin != ind_stdout
-	&& isatty(stdin_fileno) && !isatty(ind_stdin)) {
+	&& stdin_tty && !(-1 < ind_stdin && ind_stdin_tty)) {
       do_close(ind_stdin);
       ind_stdin = -1;
     }
     
     /* if stdin != stdout then echo anything read from stdin to stdout */
     if ((-1 < ind_stdin)
-	&& isatty(ind_stdin)
+	&& ind_stdin_tty
 	&& (ind_stdin != ind_stdout)
 	&& FD_ISSET(ind_stdin, &fds)) {
       if (verbose > 1) {
 	fprintf(stderr, "%s: read()ing ind_stdin\n", argv0);
       }
-      if (isatty(ind_stdout)) {
-	if (process(ind_stdin, STDOUT_FILENO, prefix, postfix, &emptyline)) {
+      if (-1 < ind_stdout && ind_stdout_tty) {
+	if (process(ind_stdin, STREAM_STDOUT, term_out)) {
 	  ind_stdin = -1;
 	}
       } else {
@@ -1061,43 +5474,21 @@ main(int argc, char **argv)
       }
     }
 
-    if (-1 < ind_stdout && FD_ISSET(ind_stdout, &fds)) {
-      if (verbose > 1) {
-	fprintf(stderr, "%s: read()ing ind_stdout\n", argv0);
-      }
-      if (process(ind_stdout, STDOUT_FILENO, prefix, postfix,&emptyline)) {
-	if (ind_stdin == ind_stdout) {
-	  ind_stdin = -1;
-	}
-	ind_stdout = -1;
-      }
-      if (verbose > 1) {
-        fprintf(stderr, "%s: \tdone read()ing ind_stdout\n", argv0);
-      }
-    }
-
-    if (-1 < ind_stderr && FD_ISSET(ind_stderr, &fds)) {
-      if (verbose > 1) {
-	fprintf(stderr, "%s: read()ing ind_stderr\n", argv0);
-      }
-      if (process(ind_stderr, STDERR_FILENO, eprefix, epostfix, &eemptyline)) {
-	ind_stderr = -1;
-      }
-      if (verbose > 1) {
-        fprintf(stderr, "%s: \tdone read()ing ind_stderr\n", argv0);
-      }
-    }
+    sched_read(&fds, &ind_stdin, &ind_stdout, &ind_stderr);
 
     if (-1 < stdin_fileno && FD_ISSET(stdin_fileno, &fds)) {
-      char buf[128];
       ssize_t n;
       if (verbose > 1) {
 	fprintf(stderr, "%s: read()ing stdin_fileno\n", argv0);
       }
-      n = read(stdin_fileno, buf, sizeof(buf));
-      if (0 > n) {
-	fprintf(stderr, "%s: read(stdin_fileno): %d %s",
-		argv0, errno, strerror(errno));
+      /* FIXME: this should be nonblocking to not deadlock with child */
+      n = forward_stdin(stdin_fileno, ind_stdin, !stdin_tty);
+      if (FORWARD_EPIPE == n) {
+	/* child closed its stdin, so nobody wants the rest */
+	stdin_fileno = -1;
+	do_close(ind_stdin);
+	ind_stdin = -1;
+      } else if (0 > n) {
 	reset_stdin_terminal();
 	exit(1);
       } else if (!n) {
@@ -1105,15 +5496,6 @@ main(int argc, char **argv)
 	/* Note: is this right even for terminals */
 	do_close(ind_stdin);
 	ind_stdin = -1;
-      } else if (-1 < ind_stdin) {
-	/* FIXME: this should be nonblocking to not deadlock with child */
-	ssize_t nw = safe_write(ind_stdin, buf, n);
-	if (nw != n) {
-	  fprintf(stderr, "%s: write(ind -> child stdin, %zd)=>%zd err=%d %s\n",
-		  argv0, n, nw, errno, strerror(errno));
-	  reset_stdin_terminal();
-	  exit(1);
-	}
       }
     }
   }
@@ -1121,23 +5503,79 @@ main(int argc, char **argv)
   if (verbose > 1) {
     fprintf(stderr, "%s: resetting terminal\n", argv0);
   }
+  if (status_mode) {
+    status_end();
+  }
+  if (screen) {
+    screen_update(NULL, NULL, 1);
+    screen_leave(screen);
+    safe_write(STDOUT_FILENO, screen->out, screen->outlen);
+  }
   reset_stdin_terminal();
 
-  {
-    int status;
+  if (!child_exited) {
     if (verbose > 1) {
       fprintf(stderr, "%s: waitpid(%d)\n", argv0, childpid);
     }
-    if (-1 == waitpid(childpid, &status, 0)) {
-      fprintf(stderr, "%s: waitpid(%d): %d %s", argv0,
-	      childpid, errno, strerror(errno));
-      status = 1;
+    while (-1 == wait_child(childpid, &child_status, 0, &child_rusage)) {
+      if (errno != EINTR) {
+        fprintf(stderr, "%s: waitpid(%d): %d %s\n", argv0,
+                childpid, errno, strerror(errno));
+        return 1;
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &child_exit_time);
+    IND_PROBE2(exit, childpid, child_status);
+  }
+  if (rusage_report) {
+    if (screen) {
+      /* the screen is gone, so back to plain lines */
+      term_err->streams = 1 << STREAM_STDERR;
     }
-    if (verbose > 1) {
-      fprintf(stderr, "%s: exiting\n", argv0);
+    rusage_line(&child_rusage,
+                (child_exit_time.tv_sec - child_start_time.tv_sec)
+                + (child_exit_time.tv_nsec - child_start_time.tv_nsec) / 1e9);
+  }
+  if (perf_report_on) {
+    char line[512];
+    if (screen) {
+      term_err->streams = 1 << STREAM_STDERR;
+    }
+    if (perf_report(&perf, line, sizeof(line))) {
+      report_line(line);
+    }
+  }
+  if (gap_max) {
+    if (screen) {
+      term_err->streams = 1 << STREAM_STDERR;
+    }
+    gap_print();
+  }
+
+  sinks_drain();
+  if (verbose) {
+    for (c = 0; c < NSTREAMS; c++) {
+      const struct stream_stats *st = &stream_stats[c];
+      fprintf(stderr, "%s: %s: %llu reads, %llu bytes, "
+              "max queue delay %lld.%03lld ms\n", argv0, stream_names[c],
+              st->reads, st->bytes,
+              st->max_delay / 1000, st->max_delay % 1000);
     }
-    return status;
   }
+  if (recorder && rec_writer_flush(recorder)) {
+    fprintf(stderr, "%s: writing recording: %s\n", argv0, strerror(errno));
+  }
+  trace_finish();
+  if (metrics_file) {
+    metrics_save(child_status);
+  }
+  if (0 <= metrics_sock) {
+    unlink(metrics_socket);
+  }
+  if (verbose > 1) {
+    fprintf(stderr, "%s: exiting\n", argv0);
+  }
+  return exit_code(child_status);
 }
 
 /**
@@ -0,0 +1,645 @@
+/* ind/inject.c - LD_PRELOAD shim for ind --inject
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Loaded into the subprocess by "ind --inject". Adds the prefix and
+ * postfix to what the process writes to stdout and stderr itself, so that
+ * the output goes straight to the real fds instead of through a pipe (or
+ * pty) and the ind process.
+ *
+ * Configuration is passed in the environment:
+ *   IND_INJECT_PREFIX, IND_INJECT_POSTFIX    stdout templates
+ *   IND_INJECT_EPREFIX, IND_INJECT_EPOSTFIX  stderr templates
+ *   IND_INJECT_IDENT    "dev:ino dev:ino" of ind's stdout and stderr,
+ *                       to tell which stream fds 1 and 2 are at startup.
+ *
+ * write() and writev() are interposed. stdio doesn't go through the
+ * interposable write(), so stdout and stderr are replaced by
+ * fopencookie() streams that do, and fileno() is interposed to give
+ * their fds.
+ *
+ * write() can be called from a signal handler or in the child of a
+ * multithreaded fork(), so nothing on that path allocates memory or
+ * takes libc locks. The templates are expanded once, at startup; ind only
+ * injects when they are constant.
+ *
+ * Which stream an fd belongs to is tracked through dup(), dup2(), dup3(),
+ * fcntl(F_DUPFD) and close(), so that a shell's "echo foo >&2" gets the
+ * stderr prefix and "cmd > file" gets none. If stdout and stderr are the
+ * same file (typically the terminal), a newly started process can't tell
+ * them apart and assumes fd 1 is stdout and fd 2 is stderr.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "format.h"
+
+#ifndef PIPE_BUF
+#define PIPE_BUF 512
+#endif
+
+/* only this many fds are tracked, higher ones are never annotated */
+#define MAX_TRACKED_FD 256
+
+struct fdstate {
+  dev_t dev;
+  ino_t ino;
+  struct template pre;
+  struct template post;
+  int emptyline;
+  char out[PIPE_BUF];    /* annotated output being built */
+  size_t outlen;
+};
+
+/* per stream: [1] is stdout, [2] is stderr */
+static struct fdstate fdstates[3];
+
+/* which stream (1 or 2) an fd refers to, 0 for none */
+static unsigned char stream_of[MAX_TRACKED_FD];
+
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_writev)(int, const struct iovec *, int);
+static int (*real_close)(int);
+static int (*real_dup)(int);
+static int (*real_dup2)(int, int);
+static int (*real_dup3)(int, int, int);
+static int (*real_fcntl)(int, int, ...);
+static int (*real_fcntl64)(int, int, ...);
+static int (*real_fileno)(FILE *);
+static int (*real_fileno_unlocked)(FILE *);
+
+/* the stdio streams that replaced stdout and stderr, by fd */
+static FILE *hooked[3];
+
+static volatile int lock = 0;
+static __thread int inside = 0;
+
+/**
+ * Just like write(), except it really really writes everything, unless
+ * there is a real (non-EINTR) error.
+ */
+static ssize_t
+safe_write(int fd, const char *buf, size_t len)
+{
+  size_t offset = 0;
+  ssize_t ret;
+
+  while (offset < len) {
+    do {
+      ret = real_write(fd, buf + offset, len - offset);
+    } while ((-1 == ret) && (errno == EINTR));
+    if (ret < 0) {
+      return ret;
+    } else if (!ret) {
+      break;
+    }
+    offset += ret;
+  }
+  return offset;
+}
+
+/**
+ * Should writes to fd be annotated, and if so as which stream?
+ */
+static struct fdstate *
+get_state(int fd)
+{
+  if (fd < 0 || fd >= MAX_TRACKED_FD || !stream_of[fd]) {
+    return NULL;
+  }
+  return &fdstates[stream_of[fd]];
+}
+
+/**
+ * newfd is now a copy of oldfd (or, if oldfd is -1, closed).
+ */
+static void
+track_dup(int oldfd, int newfd)
+{
+  if (newfd < 0 || newfd >= MAX_TRACKED_FD) {
+    return;
+  }
+  if (oldfd < 0 || oldfd >= MAX_TRACKED_FD) {
+    stream_of[newfd] = 0;
+  } else {
+    stream_of[newfd] = stream_of[oldfd];
+  }
+}
+
+/**
+ * Write out what's been built so far.
+ */
+static int
+out_flush(int fd, struct fdstate *st)
+{
+  size_t len = st->outlen;
+
+  st->outlen = 0;
+  if (len && 0 > safe_write(fd, st->out, len)) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Append to the output being built for st. What doesn't fit is written
+ * out.
+ *
+ * @return  0 on success, -1 on write error
+ */
+static int
+out_append(int fd, struct fdstate *st, const char *p, size_t n)
+{
+  if (st->outlen + n > sizeof(st->out)) {
+    if (out_flush(fd, st)) {
+      return -1;
+    }
+    if (n > sizeof(st->out)) {
+      return 0 > safe_write(fd, p, n) ? -1 : 0;
+    }
+  }
+  memcpy(st->out + st->outlen, p, n);
+  st->outlen += n;
+  return 0;
+}
+
+/**
+ * Same line handling as process() in ind.c. Whole lines are written with
+ * one write() each, and lines are batched together as long as the batch
+ * fits in PIPE_BUF, so lines don't get split up by other writers. The
+ * caller calls out_flush() when done.
+ *
+ * @return  0 on success, -1 on error
+ */
+static int
+annotate(int fd, struct fdstate *st, const char *p, size_t n)
+{
+  const char *pre = st->pre.text;
+  const char *post = st->post.text;
+  const size_t prelen = st->pre.len;
+  const size_t postlen = st->post.len;
+  char *q;
+
+  while ((q = mempbrk(p, "\r\n", n))) {
+    size_t seglen = (st->emptyline ? prelen : 0) + (q - p) + postlen + 1;
+
+    if (st->outlen && st->outlen + seglen > sizeof(st->out)) {
+      if (out_flush(fd, st)) {
+        goto errout;
+      }
+    }
+    if ((st->emptyline && out_append(fd, st, pre, prelen))
+        || out_append(fd, st, p, q - p)
+        || out_append(fd, st, post, postlen)
+        || out_append(fd, st, q, 1)) {
+      goto errout;
+    }
+    st->emptyline = 1;
+    n -= q - p + 1;
+    p = q + 1;
+  }
+  if (n) {
+    if ((st->emptyline && out_append(fd, st, pre, prelen))
+        || out_append(fd, st, p, n)) {
+      goto errout;
+    }
+    st->emptyline = 0;
+  }
+  return 0;
+
+ errout:
+  st->outlen = 0;
+  return -1;
+}
+
+static void
+lock_acquire(void)
+{
+  while (__sync_lock_test_and_set(&lock, 1)) {
+    sched_yield();
+  }
+}
+
+static void
+lock_release(void)
+{
+  __sync_lock_release(&lock);
+}
+
+/* pthread_atfork() handlers. A fork() while another thread holds the lock
+ * would leave it held in the child for good. */
+static int atfork_locked = 0;
+
+static void
+atfork_prepare(void)
+{
+  if (!inside) {
+    lock_acquire();
+    atfork_locked = 1;
+  }
+}
+
+static void
+atfork_done(void)
+{
+  if (atfork_locked) {
+    atfork_locked = 0;
+    lock_release();
+  }
+}
+
+/**
+ * write() on an annotated fd. If we're called from within ourselves (e.g.
+ * an error message while formatting), pass through instead of deadlocking.
+ */
+static ssize_t
+ind_write(int fd, const void *buf, size_t len)
+{
+  struct fdstate *st;
+  ssize_t ret;
+
+  if (inside) {
+    return real_write(fd, buf, len);
+  }
+  inside = 1;
+  lock_acquire();
+  if (!(st = get_state(fd))) {
+    lock_release();
+    inside = 0;
+    return real_write(fd, buf, len);
+  }
+  ret = annotate(fd, st, buf, len) || out_flush(fd, st) ? -1 : (ssize_t)len;
+  lock_release();
+  inside = 0;
+  return ret;
+}
+
+ssize_t
+write(int fd, const void *buf, size_t len)
+{
+  return ind_write(fd, buf, len);
+}
+
+ssize_t
+writev(int fd, const struct iovec *iov, int iovcnt)
+{
+  struct fdstate *st;
+  ssize_t ret = 0;
+  int c;
+
+  if (inside) {
+    return real_writev(fd, iov, iovcnt);
+  }
+  inside = 1;
+  lock_acquire();
+  if (!(st = get_state(fd))) {
+    lock_release();
+    inside = 0;
+    return real_writev(fd, iov, iovcnt);
+  }
+  for (c = 0; c < iovcnt && ret >= 0; c++) {
+    if (annotate(fd, st, iov[c].iov_base, iov[c].iov_len)) {
+      ret = -1;
+    } else {
+      ret += iov[c].iov_len;
+    }
+  }
+  if (out_flush(fd, st)) {
+    ret = -1;
+  }
+  lock_release();
+  inside = 0;
+  return ret;
+}
+
+/*
+ * Everything that can change what an fd refers to.
+ */
+int
+close(int fd)
+{
+  int ret = real_close(fd);
+  track_dup(-1, fd);
+  return ret;
+}
+
+int
+dup(int oldfd)
+{
+  int ret = real_dup(oldfd);
+  track_dup(oldfd, ret);
+  return ret;
+}
+
+int
+dup2(int oldfd, int newfd)
+{
+  int ret = real_dup2(oldfd, newfd);
+  if (ret >= 0) {
+    track_dup(oldfd, newfd);
+  }
+  return ret;
+}
+
+int
+dup3(int oldfd, int newfd, int flags)
+{
+  int ret = real_dup3(oldfd, newfd, flags);
+  if (ret >= 0) {
+    track_dup(oldfd, newfd);
+  }
+  return ret;
+}
+
+/* what fcntl()'s third argument is */
+enum {
+  FCNTL_NONE,
+  FCNTL_INT,
+  FCNTL_PTR,
+};
+
+/**
+ * fcntl()'s third argument is missing, an int or a pointer, depending on
+ * cmd. Reading it as the wrong type is undefined, so sort them the way
+ * glibc's own fcntl() does.
+ */
+static int
+fcntl_arg(int cmd)
+{
+  switch (cmd) {
+  case F_GETFD:
+  case F_GETFL:
+  case F_GETOWN:
+#ifdef F_GETSIG
+  case F_GETSIG:
+#endif
+#ifdef F_GETLEASE
+  case F_GETLEASE:
+#endif
+#ifdef F_GETPIPE_SZ
+  case F_GETPIPE_SZ:
+#endif
+#ifdef F_GET_SEALS
+  case F_GET_SEALS:
+#endif
+    return FCNTL_NONE;
+  case F_GETLK:
+  case F_SETLK:
+  case F_SETLKW:
+#ifdef F_OFD_GETLK
+  case F_OFD_GETLK:
+  case F_OFD_SETLK:
+  case F_OFD_SETLKW:
+#endif
+#ifdef F_GETOWN_EX
+  case F_GETOWN_EX:
+  case F_SETOWN_EX:
+#endif
+#ifdef F_GET_RW_HINT
+  case F_GET_RW_HINT:
+  case F_SET_RW_HINT:
+  case F_GET_FILE_RW_HINT:
+  case F_SET_FILE_RW_HINT:
+#endif
+    return FCNTL_PTR;
+  default:
+    return FCNTL_INT;
+  }
+}
+
+/**
+ * Pass on an fcntl() call, with its argument as the type it is.
+ */
+static int
+do_fcntl(int (*real)(int, int, ...), int fd, int cmd, va_list ap)
+{
+  int ret;
+
+  switch (fcntl_arg(cmd)) {
+  case FCNTL_NONE:
+    ret = real(fd, cmd);
+    break;
+  case FCNTL_PTR:
+    ret = real(fd, cmd, va_arg(ap, void *));
+    break;
+  default:
+    ret = real(fd, cmd, va_arg(ap, int));
+    break;
+  }
+  if (ret >= 0 && (cmd == F_DUPFD
+#ifdef F_DUPFD_CLOEXEC
+                   || cmd == F_DUPFD_CLOEXEC
+#endif
+                   )) {
+    track_dup(fd, ret);
+  }
+  return ret;
+}
+
+int
+fcntl(int fd, int cmd, ...)
+{
+  va_list ap;
+  int ret;
+
+  va_start(ap, cmd);
+  ret = do_fcntl(real_fcntl, fd, cmd, ap);
+  va_end(ap);
+  return ret;
+}
+
+/* newer glibc redirects fcntl() to this */
+int
+fcntl64(int fd, int cmd, ...)
+{
+  va_list ap;
+  int ret;
+
+  va_start(ap, cmd);
+  ret = do_fcntl(real_fcntl64 ? real_fcntl64 : real_fcntl, fd, cmd, ap);
+  va_end(ap);
+  return ret;
+}
+
+#ifdef HAVE_FOPENCOOKIE
+static ssize_t
+cookie_write(void *cookie, const char *buf, size_t len)
+{
+  return ind_write((int)(intptr_t)cookie, buf, len);
+}
+
+/**
+ * Replace a stdio stream with one that writes through ind_write().
+ */
+static void
+hook_stdio(FILE **fp, int fd, int mode)
+{
+  static cookie_io_functions_t funcs = { NULL, cookie_write, NULL, NULL };
+  FILE *f;
+
+  if (!(f = fopencookie((void *)(intptr_t)fd, "w", funcs))) {
+    return;
+  }
+  setvbuf(f, NULL, mode, BUFSIZ);
+  fflush(*fp);
+  *fp = f;
+  hooked[fd] = f;
+}
+
+/**
+ * fileno() on a cookie stream is -1, which makes e.g. Python think there
+ * is no stdout at all. Give the fd the stream writes to.
+ */
+static int
+hooked_fileno(FILE *f, int (*real)(FILE *))
+{
+  int fd;
+
+  for (fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd++) {
+    if (f && f == hooked[fd]) {
+      return fd;
+    }
+  }
+  if (!real) {
+    errno = EBADF;
+    return -1;
+  }
+  return real(f);
+}
+
+int
+fileno(FILE *f)
+{
+  return hooked_fileno(f, real_fileno);
+}
+
+int
+fileno_unlocked(FILE *f)
+{
+  return hooked_fileno(f, real_fileno_unlocked ? real_fileno_unlocked
+                       : real_fileno);
+}
+#endif
+
+/**
+ * Read a template from the environment, with a default.
+ */
+static const char *
+getenv_default(const char *name, const char *def)
+{
+  const char *ret = getenv(name);
+  return ret ? ret : def;
+}
+
+static void __attribute__((constructor))
+ind_inject_init(void)
+{
+  unsigned long long dev[2], ino[2];
+  const char *ident;
+  struct stat sb;
+  int fd;
+
+  real_write = (ssize_t (*)(int, const void *, size_t))dlsym(RTLD_NEXT,
+                                                             "write");
+  real_writev = (ssize_t (*)(int, const struct iovec *, int))
+    dlsym(RTLD_NEXT, "writev");
+  real_close = (int (*)(int))dlsym(RTLD_NEXT, "close");
+  real_dup = (int (*)(int))dlsym(RTLD_NEXT, "dup");
+  real_dup2 = (int (*)(int, int))dlsym(RTLD_NEXT, "dup2");
+  real_dup3 = (int (*)(int, int, int))dlsym(RTLD_NEXT, "dup3");
+  real_fcntl = (int (*)(int, int, ...))dlsym(RTLD_NEXT, "fcntl");
+  real_fcntl64 = (int (*)(int, int, ...))dlsym(RTLD_NEXT, "fcntl64");
+  real_fileno = (int (*)(FILE *))dlsym(RTLD_NEXT, "fileno");
+  real_fileno_unlocked = (int (*)(FILE *))dlsym(RTLD_NEXT,
+                                                "fileno_unlocked");
+
+  if (!(ident = getenv("IND_INJECT_IDENT"))
+      || 4 != sscanf(ident, "%llu:%llu %llu:%llu",
+                     &dev[0], &ino[0], &dev[1], &ino[1])) {
+    return;
+  }
+
+  template_init(&fdstates[STDOUT_FILENO].pre,
+                getenv_default("IND_INJECT_PREFIX", "  "), 0);
+  template_init(&fdstates[STDOUT_FILENO].post,
+                getenv_default("IND_INJECT_POSTFIX", ""), 0);
+  template_init(&fdstates[STDERR_FILENO].pre,
+                getenv_default("IND_INJECT_EPREFIX", ">>"), 0);
+  template_init(&fdstates[STDERR_FILENO].post,
+                getenv_default("IND_INJECT_EPOSTFIX", ""), 0);
+
+  for (fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd++) {
+    fdstates[fd].dev = (dev_t)dev[fd - 1];
+    fdstates[fd].ino = (ino_t)ino[fd - 1];
+    fdstates[fd].emptyline = 1;
+  }
+  pthread_atfork(atfork_prepare, atfork_done, atfork_done);
+
+  /* fd 1 and 2 may have been swapped or redirected on the way here */
+  for (fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd++) {
+    const int other = STDOUT_FILENO + STDERR_FILENO - fd;
+    if (fstat(fd, &sb)) {
+      continue;
+    }
+    if (sb.st_dev == fdstates[fd].dev && sb.st_ino == fdstates[fd].ino) {
+      stream_of[fd] = fd;
+    } else if (sb.st_dev == fdstates[other].dev
+               && sb.st_ino == fdstates[other].ino) {
+      stream_of[fd] = other;
+    }
+  }
+
+#ifdef HAVE_FOPENCOOKIE
+  if (stream_of[STDOUT_FILENO]) {
+    hook_stdio(&stdout, STDOUT_FILENO, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF);
+  }
+  if (stream_of[STDERR_FILENO]) {
+    hook_stdio(&stderr, STDERR_FILENO, _IONBF);
+  }
+#endif
+}
@@ -0,0 +1,190 @@
+/* ind/json.c - JSON string escaping
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define JSON_SSE2 1
+#endif
+
+#include "json.h"
+
+static const char hexdigits[] = "0123456789abcdef";
+
+/**
+ * Check for a valid UTF-8 sequence (no overlong forms, no surrogates,
+ * nothing above U+10FFFF).
+ *
+ * @param   p:    first byte of the sequence (>= 0x80)
+ * @param   len:  bytes available at p
+ *
+ * @return  length of the sequence, or 0 if it's not valid UTF-8
+ */
+static size_t
+utf8_seqlen(const unsigned char *p, size_t len)
+{
+  const unsigned char c = p[0];
+
+  if (c >= 0xc2 && c <= 0xdf) {
+    if (len < 2 || (p[1] & 0xc0) != 0x80) {
+      return 0;
+    }
+    return 2;
+  }
+  if (c >= 0xe0 && c <= 0xef) {
+    if (len < 3 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80) {
+      return 0;
+    }
+    if ((c == 0xe0 && p[1] < 0xa0) || (c == 0xed && p[1] > 0x9f)) {
+      return 0;
+    }
+    return 3;
+  }
+  if (c >= 0xf0 && c <= 0xf4) {
+    if (len < 4
+        || (p[1] & 0xc0) != 0x80
+        || (p[2] & 0xc0) != 0x80
+        || (p[3] & 0xc0) != 0x80) {
+      return 0;
+    }
+    if ((c == 0xf0 && p[1] < 0x90) || (c == 0xf4 && p[1] > 0x8f)) {
+      return 0;
+    }
+    return 4;
+  }
+  return 0;
+}
+
+/**
+ * Escape one byte that can't be copied as-is. Valid UTF-8 sequences
+ * are copied whole, invalid bytes become U+FFFD.
+ *
+ * @param   dstp:  output pointer, advanced past what was written
+ * @param   src:   byte to escape
+ * @param   len:   bytes available at src
+ *
+ * @return  number of input bytes consumed
+ */
+static size_t
+escape_special(char **dstp, const unsigned char *src, size_t len)
+{
+  char *dst = *dstp;
+  const unsigned char c = *src;
+  size_t n;
+
+  switch (c) {
+  case '"':  *dst++ = '\\'; *dst++ = '"';  break;
+  case '\\': *dst++ = '\\'; *dst++ = '\\'; break;
+  case '\b': *dst++ = '\\'; *dst++ = 'b';  break;
+  case '\f': *dst++ = '\\'; *dst++ = 'f';  break;
+  case '\n': *dst++ = '\\'; *dst++ = 'n';  break;
+  case '\r': *dst++ = '\\'; *dst++ = 'r';  break;
+  case '\t': *dst++ = '\\'; *dst++ = 't';  break;
+  default:
+    if (c < 0x20) {
+      memcpy(dst, "\\u00", 4);
+      dst[4] = hexdigits[c >> 4];
+      dst[5] = hexdigits[c & 0xf];
+      dst += 6;
+    } else if ((n = utf8_seqlen(src, len))) {
+      memcpy(dst, src, n);
+      *dstp = dst + n;
+      return n;
+    } else {
+      memcpy(dst, "\\ufffd", 6);
+      dst += 6;
+    }
+  }
+  *dstp = dst;
+  return 1;
+}
+
+/**
+ * Escape a string for use inside a JSON string literal. The string need
+ * not be valid UTF-8 and may contain NUL bytes.
+ *
+ * Runs of bytes that need no escaping are copied in bulk, 16 bytes at a
+ * time where SSE2 is available.
+ *
+ * @param   dst:   output buffer, at least JSON_ESCAPE_MAX(len) bytes
+ * @param   src:   string to escape
+ * @param   len:   length of src
+ *
+ * @return  number of bytes written to dst (not NUL-terminated)
+ */
+size_t
+json_escape(char *dst, const char *src, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)src;
+  const unsigned char *end = p + len;
+  char *out = dst;
+
+#ifdef JSON_SSE2
+  {
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+
+    while (end - p >= 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)p);
+      /* signed compare, so bytes >= 0x80 count as "less than space" too */
+      __m128i m = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                               _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                            _mm_cmpeq_epi8(v, bslash)));
+      int mask = _mm_movemask_epi8(m);
+      size_t clean;
+
+      if (!mask) {
+        _mm_storeu_si128((__m128i *)out, v);
+        p += 16;
+        out += 16;
+        continue;
+      }
+      clean = __builtin_ctz(mask);
+      memcpy(out, p, clean);
+      out += clean;
+      p += clean;
+      p += escape_special(&out, p, end - p);
+    }
+  }
+#endif
+
+  while (p < end) {
+    if (*p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\') {
+      *out++ = *p++;
+      continue;
+    }
+    p += escape_special(&out, p, end - p);
+  }
+  return out - dst;
+}
@@ -0,0 +1,215 @@
+/* ind/logindex.c - sidecar time index for --log files
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "logindex.h"
+
+/*
+ * Entries are fixed size and in time order, so a lookup is a binary
+ * search with pread(), touching O(log n) pages of even a huge index.
+ */
+
+/**
+ * Open an index.
+ *
+ * @param   path     index file
+ * @param   append   open for appending, creating it if needed. Otherwise
+ *                   read only.
+ *
+ * @return  fd, or -1 on error (errno set, EINVAL if it's not an index)
+ */
+int
+idx_open(const char *path, int append)
+{
+  struct stat st;
+  int fd;
+
+  fd = append ? open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666)
+    : open(path, O_RDONLY | O_CLOEXEC);
+  if (0 > fd) {
+    return -1;
+  }
+  if (fstat(fd, &st)) {
+    close(fd);
+    return -1;
+  }
+  if (!st.st_size && append) {
+    if (IDX_MAGIC_LEN != write(fd, IDX_MAGIC, IDX_MAGIC_LEN)) {
+      close(fd);
+      return -1;
+    }
+  } else {
+    char magic[IDX_MAGIC_LEN];
+    if (IDX_MAGIC_LEN != pread(fd, magic, IDX_MAGIC_LEN, 0)
+        || memcmp(magic, IDX_MAGIC, IDX_MAGIC_LEN)) {
+      close(fd);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  return fd;
+}
+
+/**
+ * Append an entry.
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+idx_add(int fd, const struct idx_entry *e)
+{
+  ssize_t n;
+
+  do {
+    n = write(fd, e, sizeof(struct idx_entry));
+  } while (-1 == n && errno == EINTR);
+  if (n != sizeof(struct idx_entry)) {
+    if (0 <= n) {
+      errno = EIO;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @return  number of entries in the index, or -1 on error
+ */
+static off_t
+idx_count(int fd)
+{
+  struct stat st;
+
+  if (fstat(fd, &st)) {
+    return -1;
+  }
+  if (st.st_size < IDX_MAGIC_LEN) {
+    errno = EINVAL;
+    return -1;
+  }
+  /* a partly written last entry doesn't count */
+  return (st.st_size - IDX_MAGIC_LEN) / sizeof(struct idx_entry);
+}
+
+/**
+ * @return  0 on success, -1 on error
+ */
+static int
+idx_get(int fd, off_t n, struct idx_entry *e)
+{
+  off_t off = IDX_MAGIC_LEN + n * sizeof(struct idx_entry);
+
+  if (sizeof(struct idx_entry) != pread(fd, e, sizeof(struct idx_entry), off)) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Get the oldest entry.
+ *
+ * @return  0 on success, 1 if the index is empty, -1 on error
+ */
+int
+idx_first(int fd, struct idx_entry *e)
+{
+  off_t n = idx_count(fd);
+
+  if (0 > n) {
+    return -1;
+  }
+  if (!n) {
+    return 1;
+  }
+  return idx_get(fd, 0, e);
+}
+
+/**
+ * Get the newest entry.
+ *
+ * @return  0 on success, 1 if the index is empty, -1 on error
+ */
+int
+idx_last(int fd, struct idx_entry *e)
+{
+  off_t n = idx_count(fd);
+
+  if (0 > n) {
+    return -1;
+  }
+  if (!n) {
+    return 1;
+  }
+  return idx_get(fd, n - 1, e);
+}
+
+/**
+ * Find the last entry at or before time_ns. If there is none, the first
+ * entry.
+ *
+ * @return  0 on success, 1 if the index is empty, -1 on error
+ */
+int
+idx_lookup(int fd, uint64_t time_ns, struct idx_entry *e)
+{
+  off_t lo = 0, hi;
+
+  if (0 > (hi = idx_count(fd))) {
+    return -1;
+  }
+  if (!hi) {
+    return 1;
+  }
+
+  /* invariant: the answer is in [lo, hi) */
+  while (hi - lo > 1) {
+    off_t mid = lo + (hi - lo) / 2;
+
+    if (idx_get(fd, mid, e)) {
+      return -1;
+    }
+    if (e->time_ns <= time_ns) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return idx_get(fd, lo, e);
+}
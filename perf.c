@@ -0,0 +1,220 @@
+/* ind/perf.c - hardware and software performance counters for the command
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perf.h"
+
+/*
+ * Counters are opened on the command before it exec()s, disabled until
+ * the exec and inherited by everything it starts, so they count the
+ * command and its children but not ind. They're read once, after the
+ * command has exited.
+ *
+ * Virtual machines often have no hardware counters. Then only the
+ * software ones are reported.
+ */
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} events[PERF_NCOUNTERS] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+  { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+  { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+  { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+};
+#endif
+
+/**
+ * Open the counters on a process that hasn't exec()ed yet.
+ *
+ * @return  number of counters opened, -1 if there's no perf_event_open()
+ *          (errno set)
+ */
+int
+perf_open(struct perf_counters *pc, pid_t pid)
+{
+  int c;
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  int n = 0;
+
+  for (c = 0; c < PERF_NCOUNTERS; c++) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[c].type;
+    attr.config = events[c].config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    /* more counters than the CPU has get time-shared. Scaled at the end */
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+      | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    pc->fd[c] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+    /* perf_event_paranoid may only allow counting user space */
+    if (pc->fd[c] < 0 && (errno == EACCES || errno == EPERM)) {
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      pc->fd[c] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+    }
+    if (pc->fd[c] >= 0) {
+      n++;
+    }
+  }
+  return n;
+#else
+  for (c = 0; c < PERF_NCOUNTERS; c++) {
+    pc->fd[c] = -1;
+  }
+  pid = pid; /* hide warning */
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/**
+ * Read a counter, scaled up if it was only counting part of the time.
+ *
+ * @return  0 on success, -1 if it's not available
+ */
+static int
+perf_read(int fd, double *v)
+{
+  uint64_t val[3];   /* value, time enabled, time running */
+
+  if (fd < 0 || sizeof(val) != read(fd, val, sizeof(val)) || !val[2]) {
+    return -1;
+  }
+  *v = (double)val[0];
+  if (val[2] < val[1]) {
+    *v *= (double)val[1] / val[2];
+  }
+  return 0;
+}
+
+/**
+ * Read the counters, close them and describe the result in buf.
+ *
+ * @return  length of the text in buf, 0 if nothing could be counted
+ */
+int
+perf_report(struct perf_counters *pc, char *buf, size_t size)
+{
+  double v[PERF_NCOUNTERS];
+  int ok[PERF_NCOUNTERS];
+  size_t n = 0;
+  int c;
+
+  for (c = 0; c < PERF_NCOUNTERS; c++) {
+    ok[c] = !perf_read(pc->fd[c], &v[c]);
+    if (pc->fd[c] >= 0) {
+      close(pc->fd[c]);
+      pc->fd[c] = -1;
+    }
+  }
+
+#define PERF_ADD(...)                                                   \
+  do {                                                                  \
+    if (n < size) {                                                     \
+      n += snprintf(buf + n, size - n, __VA_ARGS__);                    \
+    }                                                                   \
+  } while (0)
+
+  PERF_ADD("perf:");
+  if (ok[PERF_TASK_CLOCK]) {
+    PERF_ADD(" %.3f ms task-clock,", v[PERF_TASK_CLOCK] / 1e6);
+  }
+  if (ok[PERF_CYCLES]) {
+    PERF_ADD(" %.0f cycles,", v[PERF_CYCLES]);
+  }
+  if (ok[PERF_INSTRUCTIONS]) {
+    PERF_ADD(" %.0f instructions", v[PERF_INSTRUCTIONS]);
+    if (ok[PERF_CYCLES] && v[PERF_CYCLES] > 0) {
+      PERF_ADD(" (%.2f IPC)", v[PERF_INSTRUCTIONS] / v[PERF_CYCLES]);
+    }
+    PERF_ADD(",");
+  }
+  if (ok[PERF_CACHE_MISSES]) {
+    PERF_ADD(" %.0f cache misses", v[PERF_CACHE_MISSES]);
+    if (ok[PERF_CACHE_REFS] && v[PERF_CACHE_REFS] > 0) {
+      PERF_ADD(" (%.2f%%)",
+               100 * v[PERF_CACHE_MISSES] / v[PERF_CACHE_REFS]);
+    }
+    PERF_ADD(",");
+  }
+  if (ok[PERF_BRANCH_MISSES]) {
+    PERF_ADD(" %.0f branch misses", v[PERF_BRANCH_MISSES]);
+    if (ok[PERF_BRANCHES] && v[PERF_BRANCHES] > 0) {
+      PERF_ADD(" (%.2f%%)", 100 * v[PERF_BRANCH_MISSES] / v[PERF_BRANCHES]);
+    }
+    PERF_ADD(",");
+  }
+  if (ok[PERF_PAGE_FAULTS]) {
+    PERF_ADD(" %.0f page faults,", v[PERF_PAGE_FAULTS]);
+  }
+  if (ok[PERF_CONTEXT_SWITCHES]) {
+    PERF_ADD(" %.0f context switches,", v[PERF_CONTEXT_SWITCHES]);
+  }
+  if (ok[PERF_MIGRATIONS]) {
+    PERF_ADD(" %.0f CPU migrations,", v[PERF_MIGRATIONS]);
+  }
+#undef PERF_ADD
+
+  if (n >= size) {
+    n = size - 1;
+  }
+  if (n <= strlen("perf:")) {
+    return 0;
+  }
+  /* no trailing comma */
+  buf[--n] = 0;
+  return n;
+}
@@ -0,0 +1,63 @@
+/* ind/probes.h - USDT probes
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Static tracepoints for bpftrace, perf and SystemTap. Until something
+ * attaches, each is a single NOP. List them with
+ *   bpftrace -l 'usdt:/usr/bin/ind:*'
+ *
+ * ind:read(fd, bytes)             a read from the command
+ * ind:prefix(stream, bytes)       a prefix was put on a line
+ * ind:write(fd, bytes, ns)        a write to a sink, and how long it took
+ * ind:wakeup(nfds)                select() returned
+ * ind:resize(rows, cols)          window size changed
+ * ind:exit(pid, status)           the command exited
+ *
+ * Without <sys/sdt.h> they compile to nothing.
+ */
+#ifdef HAVE_SYS_SDT_H
+/* with semaphores, probe arguments that cost something to work out are
+ * only worked out while someone is listening */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define IND_PROBE_SEMAPHORE(name)                               \
+  unsigned short ind_##name##_semaphore                         \
+  __attribute__((unused)) __attribute__((section(".probes")))
+#define IND_PROBE_ENABLED(name) __builtin_expect(ind_##name##_semaphore, 0)
+#define IND_PROBE1(name, a) STAP_PROBE1(ind, name, a)
+#define IND_PROBE2(name, a, b) STAP_PROBE2(ind, name, a, b)
+#define IND_PROBE3(name, a, b, c) STAP_PROBE3(ind, name, a, b, c)
+#else
+#define IND_PROBE_SEMAPHORE(name) extern int ind_no_probes
+#define IND_PROBE_ENABLED(name) 0
+#define IND_PROBE1(name, a) do { (void)(a); } while (0)
+#define IND_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define IND_PROBE3(name, a, b, c) \
+  do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
@@ -0,0 +1,262 @@
+/* ind/record.c - session recording (--record/--replay)
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "record.h"
+
+/*
+ * A recording is one or more sessions, each starting with REC_MAGIC and
+ * followed by records:
+ *
+ *   type      1 byte (REC_STDOUT, REC_STDERR or REC_STDIN)
+ *   delta     varint, microseconds since the previous record
+ *   length    varint
+ *   data      length bytes, as read
+ *
+ * Varints are little endian base 128, as in protobuf. Recordings are only
+ * ever appended to, so recording again to the same file adds a session.
+ */
+
+/**
+ * Write out the buffer.
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+rec_writer_flush(struct rec_writer *w)
+{
+  const char *p = w->buf;
+
+  while (w->len) {
+    ssize_t n = write(w->fd, p, w->len);
+    if (0 > n) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    w->len -= n;
+  }
+  return 0;
+}
+
+/**
+ * Open a recording for appending and start a new session in it.
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+rec_writer_open(struct rec_writer *w, const char *path)
+{
+  if (0 > (w->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                        0666))) {
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &w->last);
+  memcpy(w->buf, REC_MAGIC, REC_MAGIC_LEN);
+  w->len = REC_MAGIC_LEN;
+  return 0;
+}
+
+/**
+ * Store v as a varint at p.
+ *
+ * @return  number of bytes used (at most 10)
+ */
+static size_t
+put_varint(char *p, unsigned long long v)
+{
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = (char)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (char)v;
+  return n;
+}
+
+/**
+ * Add a chunk of data to the recording. Only actually written when the
+ * buffer is full, or on rec_writer_flush().
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+rec_write(struct rec_writer *w, int type, const char *p, size_t n)
+{
+  struct timespec now;
+  unsigned long long delta;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  delta = (now.tv_sec - w->last.tv_sec) * 1000000ULL
+    + now.tv_nsec / 1000 - w->last.tv_nsec / 1000;
+  w->last = now;
+
+  if (w->len + 1 + 20 + n > sizeof(w->buf)) {
+    if (rec_writer_flush(w)) {
+      return -1;
+    }
+  }
+  w->buf[w->len++] = (char)type;
+  w->len += put_varint(w->buf + w->len, delta);
+  w->len += put_varint(w->buf + w->len, n);
+  if (n > sizeof(w->buf) - w->len) {
+    /* doesn't fit even in an empty buffer. Write it directly. */
+    if (rec_writer_flush(w)) {
+      return -1;
+    }
+    while (n) {
+      ssize_t wr = write(w->fd, p, n);
+      if (0 > wr) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return -1;
+      }
+      p += wr;
+      n -= wr;
+    }
+    return 0;
+  }
+  memcpy(w->buf + w->len, p, n);
+  w->len += n;
+  return 0;
+}
+
+/**
+ * Open a recording for reading.
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+rec_reader_open(struct rec_reader *r, const char *path)
+{
+  char magic[REC_MAGIC_LEN];
+
+  memset(r, 0, sizeof(struct rec_reader));
+  if (!(r->f = fopen(path, "rb"))) {
+    return -1;
+  }
+  if (1 != fread(magic, sizeof(magic), 1, r->f)
+      || memcmp(magic, REC_MAGIC, REC_MAGIC_LEN)) {
+    fclose(r->f);
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @return  0 on success, -1 on EOF or overflow
+ */
+static int
+get_varint(FILE *f, unsigned long long *v)
+{
+  int shift = 0;
+  int c;
+
+  *v = 0;
+  do {
+    if (EOF == (c = getc(f)) || shift > 63) {
+      return -1;
+    }
+    *v |= (unsigned long long)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 0;
+}
+
+/**
+ * Read the next record. The data pointer is valid until the next call.
+ * A new session shows up as a record of type REC_STDOUT with no data and
+ * no delta.
+ *
+ * @return  1 on success, 0 on EOF, -1 if the file is corrupt (errno set)
+ */
+int
+rec_read(struct rec_reader *r, int *type, unsigned long long *delta_us,
+         const char **p, size_t *n)
+{
+  unsigned long long len;
+  int c;
+
+  if (EOF == (c = getc(r->f))) {
+    return ferror(r->f) ? -1 : 0;
+  }
+  if (c == REC_MAGIC[0]) {
+    char magic[REC_MAGIC_LEN];
+    magic[0] = c;
+    if (1 != fread(magic + 1, REC_MAGIC_LEN - 1, 1, r->f)
+        || memcmp(magic, REC_MAGIC, REC_MAGIC_LEN)) {
+      errno = EINVAL;
+      return -1;
+    }
+    *type = REC_STDOUT;
+    *delta_us = 0;
+    *n = 0;
+    *p = r->buf;
+    return 1;
+  }
+  if (c != REC_STDOUT && c != REC_STDERR && c != REC_STDIN) {
+    errno = EINVAL;
+    return -1;
+  }
+  *type = c;
+  if (get_varint(r->f, delta_us) || get_varint(r->f, &len)
+      || len > REC_MAX_LEN) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (len > r->size) {
+    char *newbuf;
+    if (!(newbuf = realloc(r->buf, len))) {
+      return -1;
+    }
+    r->buf = newbuf;
+    r->size = len;
+  }
+  if (len && 1 != fread(r->buf, len, 1, r->f)) {
+    errno = EINVAL;
+    return -1;
+  }
+  *p = r->buf;
+  *n = len;
+  return 1;
+}
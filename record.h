@@ -0,0 +1,65 @@
+/* ind/record.h - session recording (--record/--replay)
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+/* record types. A record starting with REC_MAGIC[0] is a new session. */
+#define REC_STDOUT 0
+#define REC_STDERR 1
+#define REC_STDIN  2
+
+/* every session in a recording starts with this */
+#define REC_MAGIC "INDREC1\n"
+#define REC_MAGIC_LEN 8
+
+/* a single record's data is never longer than this */
+#define REC_MAX_LEN (16 * 1048576)
+
+struct rec_writer {
+  int fd;
+  struct timespec last;
+  size_t len;
+  char buf[65536];
+};
+
+struct rec_reader {
+  FILE *f;
+  char *buf;
+  size_t size;
+};
+
+int rec_writer_open(struct rec_writer *w, const char *path);
+int rec_write(struct rec_writer *w, int type, const char *p, size_t n);
+int rec_writer_flush(struct rec_writer *w);
+
+int rec_reader_open(struct rec_reader *r, const char *path);
+int rec_read(struct rec_reader *r, int *type, unsigned long long *delta_us,
+             const char **p, size_t *n);
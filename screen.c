@@ -0,0 +1,1083 @@
+/* ind/screen.c - in-memory terminal screen for --screen
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "screen.h"
+
+/*
+ * The program's output is run through the parser into a screen model
+ * (s->line). screen_render() then compares it with what the real terminal
+ * was last sent (s->shown) and writes only the cells that differ, offset
+ * by the prefix width.
+ */
+
+static const struct cell blank = { ' ', COLOR_DEFAULT, COLOR_DEFAULT, 0 };
+
+/**
+ * Append to the output for the real terminal.
+ */
+static void
+out_add(struct screen *s, const char *p, size_t n)
+{
+  if (s->outlen + n > s->outsize) {
+    size_t newsize = s->outsize ? s->outsize : 4096;
+    char *newbuf;
+
+    while (newsize < s->outlen + n) {
+      newsize *= 2;
+    }
+    if (!(newbuf = realloc(s->out, newsize))) {
+      fprintf(stderr, "ind: Memory alloc of %zd bytes failed!\n", newsize);
+      exit(1);
+    }
+    s->out = newbuf;
+    s->outsize = newsize;
+  }
+  memcpy(s->out + s->outlen, p, n);
+  s->outlen += n;
+}
+
+/**
+ * Append a formatted string to the output for the real terminal.
+ */
+static void
+out_printf(struct screen *s, const char *fmt, int a, int b)
+{
+  char buf[32];
+  int n = snprintf(buf, sizeof(buf), fmt, a, b);
+  out_add(s, buf, n);
+}
+
+/**
+ * Allocate rows of blank cells.
+ */
+static struct cell **
+lines_new(int rows, int cols, const struct cell *fill)
+{
+  struct cell **l;
+  int y, x;
+
+  if (!(l = malloc(rows * sizeof(struct cell*)))) {
+    fprintf(stderr, "ind: Memory alloc of screen failed!\n");
+    exit(1);
+  }
+  for (y = 0; y < rows; y++) {
+    if (!(l[y] = malloc(cols * sizeof(struct cell)))) {
+      fprintf(stderr, "ind: Memory alloc of screen failed!\n");
+      exit(1);
+    }
+    for (x = 0; x < cols; x++) {
+      l[y][x] = *fill;
+    }
+  }
+  return l;
+}
+
+/**
+ *
+ */
+static void
+lines_free(struct cell **l, int rows)
+{
+  int y;
+
+  if (!l) {
+    return;
+  }
+  for (y = 0; y < rows; y++) {
+    free(l[y]);
+  }
+  free(l);
+}
+
+/**
+ * The cell erased cells get: blank, but with the current background.
+ */
+static struct cell
+erased(const struct screen *s)
+{
+  struct cell c = blank;
+  c.bg = s->pen.bg;
+  return c;
+}
+
+/**
+ * Erase cells [x0, x1) of row y.
+ */
+static void
+erase(struct screen *s, int y, int x0, int x1)
+{
+  struct cell e = erased(s);
+  int x;
+
+  for (x = x0; x < x1; x++) {
+    s->line[y][x] = e;
+  }
+  s->dirty[y] = 1;
+}
+
+/**
+ * Scroll rows [top, bot] up by n, blanking at the bottom.
+ */
+static void
+scroll_up(struct screen *s, int top, int bot, int n)
+{
+  struct cell *tmp[n > 0 ? n : 1];
+  int y;
+
+  if (n > bot - top + 1) {
+    n = bot - top + 1;
+  }
+  if (n <= 0) {
+    return;
+  }
+  memcpy(tmp, &s->line[top], n * sizeof(struct cell*));
+  memmove(&s->line[top], &s->line[top + n],
+          (bot - top + 1 - n) * sizeof(struct cell*));
+  memcpy(&s->line[bot - n + 1], tmp, n * sizeof(struct cell*));
+  for (y = bot - n + 1; y <= bot; y++) {
+    erase(s, y, 0, s->cols);
+  }
+  memset(s->dirty + top, 1, bot - top + 1);
+}
+
+/**
+ * Scroll rows [top, bot] down by n, blanking at the top.
+ */
+static void
+scroll_down(struct screen *s, int top, int bot, int n)
+{
+  struct cell *tmp[n > 0 ? n : 1];
+  int y;
+
+  if (n > bot - top + 1) {
+    n = bot - top + 1;
+  }
+  if (n <= 0) {
+    return;
+  }
+  memcpy(tmp, &s->line[bot - n + 1], n * sizeof(struct cell*));
+  memmove(&s->line[top + n], &s->line[top],
+          (bot - top + 1 - n) * sizeof(struct cell*));
+  memcpy(&s->line[top], tmp, n * sizeof(struct cell*));
+  for (y = top; y < top + n; y++) {
+    erase(s, y, 0, s->cols);
+  }
+  memset(s->dirty + top, 1, bot - top + 1);
+}
+
+/**
+ *
+ */
+static void
+linefeed(struct screen *s)
+{
+  if (s->cy == s->bot) {
+    scroll_up(s, s->top, s->bot, 1);
+  } else if (s->cy < s->rows - 1) {
+    s->cy++;
+  }
+}
+
+/**
+ *
+ */
+static void
+reverse_index(struct screen *s)
+{
+  if (s->cy == s->top) {
+    scroll_down(s, s->top, s->bot, 1);
+  } else if (s->cy > 0) {
+    s->cy--;
+  }
+}
+
+/**
+ * Keep the cursor on the screen.
+ */
+static void
+clamp_cursor(struct screen *s)
+{
+  if (s->cx < 0) {
+    s->cx = 0;
+  }
+  if (s->cx >= s->cols) {
+    s->cx = s->cols - 1;
+  }
+  if (s->cy < 0) {
+    s->cy = 0;
+  }
+  if (s->cy >= s->rows) {
+    s->cy = s->rows - 1;
+  }
+  s->wrapnext = 0;
+}
+
+/**
+ * Put a character at the cursor and advance it.
+ */
+static void
+put_char(struct screen *s, uint32_t ch)
+{
+  struct cell c;
+
+  if (s->wrapnext) {
+    s->cx = 0;
+    s->wrapnext = 0;
+    linefeed(s);
+  }
+  c = s->pen;
+  c.ch = ch;
+  s->line[s->cy][s->cx] = c;
+  s->dirty[s->cy] = 1;
+  if (s->cx == s->cols - 1) {
+    s->wrapnext = s->autowrap;
+  } else {
+    s->cx++;
+  }
+}
+
+/**
+ * vt callback: text. Decoded from UTF-8 here, since sequences can be split
+ * between reads.
+ */
+static void
+cb_print(void *ctx, const char *buf, size_t n)
+{
+  struct screen *s = ctx;
+  const unsigned char *p = (const unsigned char*)buf;
+  const unsigned char *end = p + n;
+
+  for (; p < end; p++) {
+    unsigned char b = *p;
+
+    if (s->uneed) {
+      if ((b & 0xc0) == 0x80) {
+        s->ucs = (s->ucs << 6) | (b & 0x3f);
+        if (!--s->uneed) {
+          put_char(s, s->ucs);
+        }
+        continue;
+      }
+      /* sequence cut short */
+      s->uneed = 0;
+      put_char(s, 0xfffd);
+    }
+    if (b < 0x80) {
+      put_char(s, b);
+    } else if ((b & 0xe0) == 0xc0) {
+      s->ucs = b & 0x1f;
+      s->uneed = 1;
+    } else if ((b & 0xf0) == 0xe0) {
+      s->ucs = b & 0x0f;
+      s->uneed = 2;
+    } else if ((b & 0xf8) == 0xf0) {
+      s->ucs = b & 0x07;
+      s->uneed = 3;
+    } else {
+      put_char(s, 0xfffd);
+    }
+  }
+}
+
+/**
+ * vt callback: C0 controls.
+ */
+static void
+cb_execute(void *ctx, int c)
+{
+  struct screen *s = ctx;
+
+  switch (c) {
+  case '\r':
+    s->cx = 0;
+    s->wrapnext = 0;
+    break;
+  case '\n':
+  case '\v':
+  case '\f':
+    linefeed(s);
+    break;
+  case '\b':
+    if (s->cx > 0) {
+      s->cx--;
+    }
+    s->wrapnext = 0;
+    break;
+  case '\t':
+    s->cx = (s->cx + 8) & ~7;
+    if (s->cx >= s->cols) {
+      s->cx = s->cols - 1;
+    }
+    break;
+  case '\a':
+    out_add(s, "\a", 1);
+    break;
+  }
+}
+
+/**
+ *
+ */
+static void
+save_cursor(struct screen *s)
+{
+  s->saved_cx = s->cx;
+  s->saved_cy = s->cy;
+  s->saved_pen = s->pen;
+}
+
+/**
+ *
+ */
+static void
+restore_cursor(struct screen *s)
+{
+  s->cx = s->saved_cx;
+  s->cy = s->saved_cy;
+  s->pen = s->saved_pen;
+  clamp_cursor(s);
+}
+
+/**
+ * Back to power-on state.
+ */
+static void
+reset(struct screen *s)
+{
+  int y;
+
+  s->pen = blank;
+  s->cx = s->cy = 0;
+  s->wrapnext = 0;
+  s->top = 0;
+  s->bot = s->rows - 1;
+  s->cursor_visible = 1;
+  s->autowrap = 1;
+  save_cursor(s);
+  for (y = 0; y < s->rows; y++) {
+    erase(s, y, 0, s->cols);
+  }
+}
+
+/**
+ * vt callback: ESC sequences.
+ */
+static void
+cb_esc(void *ctx, int final, const char *inter, int ninter)
+{
+  struct screen *s = ctx;
+
+  if (ninter) {
+    /* character sets and such */
+    (void)inter;
+    return;
+  }
+  switch (final) {
+  case '7':
+    save_cursor(s);
+    break;
+  case '8':
+    restore_cursor(s);
+    break;
+  case 'D':
+    linefeed(s);
+    break;
+  case 'E':
+    s->cx = 0;
+    linefeed(s);
+    break;
+  case 'M':
+    reverse_index(s);
+    break;
+  case 'c':
+    reset(s);
+    break;
+  case '=':
+    /* keypad modes are for the real terminal */
+    out_add(s, "\033=", 2);
+    break;
+  case '>':
+    out_add(s, "\033>", 2);
+    break;
+  }
+}
+
+/**
+ * Switch to or from the alternate screen.
+ */
+static void
+alt_screen(struct screen *s, int on)
+{
+  int y;
+
+  if (on && !s->altsave) {
+    s->altsave = s->line;
+    s->altsave_cx = s->cx;
+    s->altsave_cy = s->cy;
+    s->line = lines_new(s->rows, s->cols, &blank);
+  } else if (!on && s->altsave) {
+    lines_free(s->line, s->rows);
+    s->line = s->altsave;
+    s->altsave = NULL;
+    s->cx = s->altsave_cx;
+    s->cy = s->altsave_cy;
+    clamp_cursor(s);
+  } else {
+    return;
+  }
+  for (y = 0; y < s->rows; y++) {
+    s->dirty[y] = 1;
+  }
+}
+
+/**
+ * CSI ? h / CSI ? l
+ */
+static void
+set_private_mode(struct screen *s, int mode, int on)
+{
+  switch (mode) {
+  case 7:
+    s->autowrap = on;
+    break;
+  case 25:
+    s->cursor_visible = on;
+    break;
+  case 47:
+  case 1047:
+  case 1049:
+    if (on && mode == 1049) {
+      save_cursor(s);
+    }
+    alt_screen(s, on);
+    if (!on && mode == 1049) {
+      restore_cursor(s);
+    }
+    break;
+  case 1:      /* application cursor keys */
+  case 1000:   /* mouse */
+  case 1002:
+  case 1003:
+  case 1006:
+  case 2004:   /* bracketed paste */
+    /* these are about input, so they're for the real terminal */
+    out_printf(s, "\033[?%d%c", mode, on ? 'h' : 'l');
+    break;
+  }
+}
+
+/**
+ * Map a 24 bit color to the 256 color palette.
+ */
+static int
+rgb256(int r, int g, int b)
+{
+  return 16 + 36 * ((r * 5 + 127) / 255) + 6 * ((g * 5 + 127) / 255)
+    + (b * 5 + 127) / 255;
+}
+
+/**
+ * CSI m
+ */
+static void
+sgr(struct screen *s, const int *params, int nparams)
+{
+  int i;
+
+  if (!nparams) {
+    s->pen = blank;
+    return;
+  }
+  for (i = 0; i < nparams; i++) {
+    int p = params[i] < 0 ? 0 : params[i];
+
+    if (p == 0) {
+      s->pen = blank;
+    } else if (p == 1) {
+      s->pen.flags |= ATTR_BOLD;
+    } else if (p == 2) {
+      s->pen.flags |= ATTR_DIM;
+    } else if (p == 3) {
+      s->pen.flags |= ATTR_ITALIC;
+    } else if (p == 4) {
+      s->pen.flags |= ATTR_UNDERLINE;
+    } else if (p == 5) {
+      s->pen.flags |= ATTR_BLINK;
+    } else if (p == 7) {
+      s->pen.flags |= ATTR_REVERSE;
+    } else if (p == 8) {
+      s->pen.flags |= ATTR_HIDDEN;
+    } else if (p == 9) {
+      s->pen.flags |= ATTR_STRIKE;
+    } else if (p == 22) {
+      s->pen.flags &= ~(ATTR_BOLD | ATTR_DIM);
+    } else if (p == 23) {
+      s->pen.flags &= ~ATTR_ITALIC;
+    } else if (p == 24) {
+      s->pen.flags &= ~ATTR_UNDERLINE;
+    } else if (p == 25) {
+      s->pen.flags &= ~ATTR_BLINK;
+    } else if (p == 27) {
+      s->pen.flags &= ~ATTR_REVERSE;
+    } else if (p == 28) {
+      s->pen.flags &= ~ATTR_HIDDEN;
+    } else if (p == 29) {
+      s->pen.flags &= ~ATTR_STRIKE;
+    } else if (p >= 30 && p <= 37) {
+      s->pen.fg = p - 30;
+    } else if (p == 39) {
+      s->pen.fg = COLOR_DEFAULT;
+    } else if (p >= 40 && p <= 47) {
+      s->pen.bg = p - 40;
+    } else if (p == 49) {
+      s->pen.bg = COLOR_DEFAULT;
+    } else if (p >= 90 && p <= 97) {
+      s->pen.fg = p - 90 + 8;
+    } else if (p >= 100 && p <= 107) {
+      s->pen.bg = p - 100 + 8;
+    } else if (p == 38 || p == 48) {
+      int color = -1;
+      if (i + 2 < nparams && params[i + 1] == 5) {
+        color = params[i + 2] & 0xff;
+        i += 2;
+      } else if (i + 4 < nparams && params[i + 1] == 2) {
+        color = rgb256(params[i + 2] & 0xff, params[i + 3] & 0xff,
+                       params[i + 4] & 0xff);
+        i += 4;
+      }
+      if (color >= 0) {
+        if (p == 38) {
+          s->pen.fg = color;
+        } else {
+          s->pen.bg = color;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * vt callback: CSI sequences.
+ */
+static void
+cb_csi(void *ctx, int final, int priv, const int *params, int nparams,
+       const char *inter, int ninter)
+{
+  struct screen *s = ctx;
+  int p0 = nparams > 0 && params[0] > 0 ? params[0] : 1;
+  int p1 = nparams > 1 && params[1] > 0 ? params[1] : 1;
+  int mode = nparams > 0 && params[0] > 0 ? params[0] : 0;
+  int y, x, i;
+
+  if (ninter) {
+    (void)inter;
+    return;
+  }
+  if (priv == '?') {
+    if (final == 'h' || final == 'l') {
+      for (i = 0; i < nparams; i++) {
+        set_private_mode(s, params[i], final == 'h');
+      }
+    }
+    return;
+  }
+  if (priv) {
+    return;
+  }
+
+  switch (final) {
+  case 'A':
+    s->cy -= p0;
+    if (s->cy < s->top && s->cy + p0 >= s->top) {
+      s->cy = s->top;
+    }
+    clamp_cursor(s);
+    break;
+  case 'B':
+  case 'e':
+    s->cy += p0;
+    if (s->cy > s->bot && s->cy - p0 <= s->bot) {
+      s->cy = s->bot;
+    }
+    clamp_cursor(s);
+    break;
+  case 'C':
+  case 'a':
+    s->cx += p0;
+    clamp_cursor(s);
+    break;
+  case 'D':
+    s->cx -= p0;
+    clamp_cursor(s);
+    break;
+  case 'E':
+    s->cy += p0;
+    s->cx = 0;
+    clamp_cursor(s);
+    break;
+  case 'F':
+    s->cy -= p0;
+    s->cx = 0;
+    clamp_cursor(s);
+    break;
+  case 'G':
+  case '`':
+    s->cx = p0 - 1;
+    clamp_cursor(s);
+    break;
+  case 'd':
+    s->cy = p0 - 1;
+    clamp_cursor(s);
+    break;
+  case 'H':
+  case 'f':
+    s->cy = p0 - 1;
+    s->cx = p1 - 1;
+    clamp_cursor(s);
+    break;
+  case 'J':
+    if (mode == 0) {
+      erase(s, s->cy, s->cx, s->cols);
+      for (y = s->cy + 1; y < s->rows; y++) {
+        erase(s, y, 0, s->cols);
+      }
+    } else if (mode == 1) {
+      for (y = 0; y < s->cy; y++) {
+        erase(s, y, 0, s->cols);
+      }
+      erase(s, s->cy, 0, s->cx + 1);
+    } else {
+      for (y = 0; y < s->rows; y++) {
+        erase(s, y, 0, s->cols);
+      }
+    }
+    break;
+  case 'K':
+    if (mode == 0) {
+      erase(s, s->cy, s->cx, s->cols);
+    } else if (mode == 1) {
+      erase(s, s->cy, 0, s->cx + 1);
+    } else {
+      erase(s, s->cy, 0, s->cols);
+    }
+    break;
+  case '@':
+    if (p0 > s->cols - s->cx) {
+      p0 = s->cols - s->cx;
+    }
+    memmove(&s->line[s->cy][s->cx + p0], &s->line[s->cy][s->cx],
+            (s->cols - s->cx - p0) * sizeof(struct cell));
+    erase(s, s->cy, s->cx, s->cx + p0);
+    break;
+  case 'P':
+    if (p0 > s->cols - s->cx) {
+      p0 = s->cols - s->cx;
+    }
+    memmove(&s->line[s->cy][s->cx], &s->line[s->cy][s->cx + p0],
+            (s->cols - s->cx - p0) * sizeof(struct cell));
+    erase(s, s->cy, s->cols - p0, s->cols);
+    break;
+  case 'X':
+    x = s->cx + p0 > s->cols ? s->cols : s->cx + p0;
+    erase(s, s->cy, s->cx, x);
+    break;
+  case 'L':
+    if (s->cy >= s->top && s->cy <= s->bot) {
+      scroll_down(s, s->cy, s->bot, p0);
+    }
+    break;
+  case 'M':
+    if (s->cy >= s->top && s->cy <= s->bot) {
+      scroll_up(s, s->cy, s->bot, p0);
+    }
+    break;
+  case 'S':
+    scroll_up(s, s->top, s->bot, p0);
+    break;
+  case 'T':
+    scroll_down(s, s->top, s->bot, p0);
+    break;
+  case 'r':
+    y = nparams > 1 && params[1] > 0 ? params[1] : s->rows;
+    if (p0 < y && y <= s->rows) {
+      s->top = p0 - 1;
+      s->bot = y - 1;
+      s->cx = s->cy = 0;
+      s->wrapnext = 0;
+    }
+    break;
+  case 'm':
+    sgr(s, params, nparams);
+    break;
+  case 's':
+    save_cursor(s);
+    break;
+  case 'u':
+    restore_cursor(s);
+    break;
+  case 'n':
+    if (mode == 6) {
+      s->replylen = snprintf(s->reply, sizeof(s->reply), "\033[%d;%dR",
+                             s->cy + 1, s->cx + 1);
+    } else if (mode == 5) {
+      s->replylen = snprintf(s->reply, sizeof(s->reply), "\033[0n");
+    }
+    break;
+  case 'c':
+    if (!mode) {
+      s->replylen = snprintf(s->reply, sizeof(s->reply), "\033[?1;2c");
+    }
+    break;
+  }
+}
+
+static const struct vt_callbacks screen_callbacks = {
+  cb_print,
+  cb_execute,
+  cb_esc,
+  cb_csi,
+};
+
+/**
+ * Create a blank screen.
+ */
+struct screen *
+screen_new(int rows, int cols)
+{
+  struct screen *s;
+
+  if (rows < 1) {
+    rows = 1;
+  }
+  if (cols < 1) {
+    cols = 1;
+  }
+  if (!(s = calloc(1, sizeof(struct screen)))
+      || !(s->dirty = malloc(rows))) {
+    fprintf(stderr, "ind: Memory alloc of screen failed!\n");
+    exit(1);
+  }
+  s->rows = rows;
+  s->cols = cols;
+  s->line = lines_new(rows, cols, &blank);
+  s->shown = lines_new(rows, cols, &blank);
+  s->full = 1;
+  reset(s);
+  vt_init(&s->vt, &screen_callbacks, s);
+  return s;
+}
+
+/**
+ *
+ */
+void
+screen_free(struct screen *s)
+{
+  lines_free(s->line, s->rows);
+  lines_free(s->shown, s->rows);
+  lines_free(s->altsave, s->rows);
+  free(s->dirty);
+  free(s->out);
+  free(s);
+}
+
+/**
+ * Feed the program's output into the screen.
+ */
+void
+screen_feed(struct screen *s, const char *p, size_t n)
+{
+  vt_feed(&s->vt, p, n);
+}
+
+/**
+ * Copy the top left of one set of lines into another.
+ */
+static void
+lines_copy(struct cell **dst, int drows, int dcols,
+           struct cell **src, int srows, int scols)
+{
+  int y;
+  int rows = drows < srows ? drows : srows;
+  int cols = dcols < scols ? dcols : scols;
+
+  for (y = 0; y < rows; y++) {
+    memcpy(dst[y], src[y], cols * sizeof(struct cell));
+  }
+}
+
+/**
+ * The window changed size. Contents are kept as far as they fit, and
+ * everything is redrawn.
+ */
+void
+screen_resize(struct screen *s, int rows, int cols)
+{
+  struct cell **l;
+
+  if (rows < 1) {
+    rows = 1;
+  }
+  if (cols < 1) {
+    cols = 1;
+  }
+  if (rows == s->rows && cols == s->cols) {
+    s->full = 1;
+    return;
+  }
+
+  l = lines_new(rows, cols, &blank);
+  lines_copy(l, rows, cols, s->line, s->rows, s->cols);
+  lines_free(s->line, s->rows);
+  s->line = l;
+  if (s->altsave) {
+    l = lines_new(rows, cols, &blank);
+    lines_copy(l, rows, cols, s->altsave, s->rows, s->cols);
+    lines_free(s->altsave, s->rows);
+    s->altsave = l;
+  }
+  lines_free(s->shown, s->rows);
+  s->shown = lines_new(rows, cols, &blank);
+  free(s->dirty);
+  if (!(s->dirty = malloc(rows))) {
+    fprintf(stderr, "ind: Memory alloc of screen failed!\n");
+    exit(1);
+  }
+
+  s->rows = rows;
+  s->cols = cols;
+  s->top = 0;
+  s->bot = rows - 1;
+  clamp_cursor(s);
+  s->full = 1;
+}
+
+/**
+ * @return  1 if screen_render() has anything to do
+ */
+int
+screen_dirty(const struct screen *s)
+{
+  int y;
+
+  if (s->full || s->outlen) {
+    return 1;
+  }
+  for (y = 0; y < s->rows; y++) {
+    if (s->dirty[y]) {
+      return 1;
+    }
+  }
+  return s->tx != s->cx || s->ty != s->cy
+    || s->tcursor_visible != s->cursor_visible;
+}
+
+/**
+ * Move the real cursor.
+ */
+static void
+move_to(struct screen *s, int y, int x, int prefixwidth)
+{
+  if (s->ty != y || s->tx != x) {
+    out_printf(s, "\033[%d;%dH", y + 1, prefixwidth + x + 1);
+    s->ty = y;
+    s->tx = x;
+  }
+}
+
+/**
+ * Set the real terminal's attributes to those of c.
+ */
+static void
+set_pen(struct screen *s, const struct cell *c)
+{
+  static const struct { int flag; const char *sgr; } flags[] = {
+    { ATTR_BOLD, ";1" }, { ATTR_DIM, ";2" }, { ATTR_ITALIC, ";3" },
+    { ATTR_UNDERLINE, ";4" }, { ATTR_BLINK, ";5" }, { ATTR_REVERSE, ";7" },
+    { ATTR_HIDDEN, ";8" }, { ATTR_STRIKE, ";9" },
+  };
+  char buf[64];
+  size_t n;
+  size_t i;
+
+  if (c->fg == s->tpen.fg && c->bg == s->tpen.bg
+      && c->flags == s->tpen.flags) {
+    return;
+  }
+  n = sprintf(buf, "\033[0");
+  for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+    if (c->flags & flags[i].flag) {
+      n += sprintf(buf + n, "%s", flags[i].sgr);
+    }
+  }
+  if (c->fg < 8) {
+    n += sprintf(buf + n, ";%d", 30 + c->fg);
+  } else if (c->fg < 16) {
+    n += sprintf(buf + n, ";%d", 90 + c->fg - 8);
+  } else if (c->fg < 256) {
+    n += sprintf(buf + n, ";38;5;%d", c->fg);
+  }
+  if (c->bg < 8) {
+    n += sprintf(buf + n, ";%d", 40 + c->bg);
+  } else if (c->bg < 16) {
+    n += sprintf(buf + n, ";%d", 100 + c->bg - 8);
+  } else if (c->bg < 256) {
+    n += sprintf(buf + n, ";48;5;%d", c->bg);
+  }
+  buf[n++] = 'm';
+  out_add(s, buf, n);
+  s->tpen = *c;
+}
+
+/**
+ * Write one cell at the real cursor.
+ */
+static void
+put_cell(struct screen *s, const struct cell *c)
+{
+  char buf[4];
+  uint32_t ch = c->ch;
+  size_t n;
+
+  set_pen(s, c);
+  if (ch < 0x20 || ch == 0x7f) {
+    ch = ' ';
+  }
+  if (ch < 0x80) {
+    buf[0] = ch;
+    n = 1;
+  } else if (ch < 0x800) {
+    buf[0] = 0xc0 | (ch >> 6);
+    buf[1] = 0x80 | (ch & 0x3f);
+    n = 2;
+  } else if (ch < 0x10000) {
+    buf[0] = 0xe0 | (ch >> 12);
+    buf[1] = 0x80 | ((ch >> 6) & 0x3f);
+    buf[2] = 0x80 | (ch & 0x3f);
+    n = 3;
+  } else {
+    buf[0] = 0xf0 | ((ch >> 18) & 0x07);
+    buf[1] = 0x80 | ((ch >> 12) & 0x3f);
+    buf[2] = 0x80 | ((ch >> 6) & 0x3f);
+    buf[3] = 0x80 | (ch & 0x3f);
+    n = 4;
+  }
+  out_add(s, buf, n);
+  /* at the right margin the real terminal's cursor is in limbo */
+  s->tx = s->tx + 1 < s->cols ? s->tx + 1 : -1;
+}
+
+/**
+ *
+ */
+static int
+cell_eq(const struct cell *a, const struct cell *b)
+{
+  return a->ch == b->ch && a->fg == b->fg && a->bg == b->bg
+    && a->flags == b->flags;
+}
+
+/**
+ * Bring the real terminal up to date. The output is left in s->out.
+ *
+ * @param   s             screen
+ * @param   prefix        formatted prefix, drawn left of every row
+ * @param   prefixwidth   its width on screen
+ */
+void
+screen_render(struct screen *s, const char *prefix, int prefixwidth)
+{
+  int y, x;
+
+  if (s->full) {
+    out_add(s, "\033[0m\033[H\033[2J", 10);
+    s->tpen = blank;
+    for (y = 0; y < s->rows; y++) {
+      out_printf(s, "\033[%d;%dH", y + 1, 1);
+      out_add(s, prefix, strlen(prefix));
+      for (x = 0; x < s->cols; x++) {
+        s->shown[y][x] = blank;
+      }
+      s->dirty[y] = 1;
+    }
+    s->tx = s->ty = -1;
+    s->tcursor_visible = -1;
+    s->full = 0;
+  }
+
+  for (y = 0; y < s->rows; y++) {
+    if (!s->dirty[y]) {
+      continue;
+    }
+    for (x = 0; x < s->cols; x++) {
+      if (cell_eq(&s->line[y][x], &s->shown[y][x])) {
+        continue;
+      }
+      /* a few unchanged cells are cheaper to rewrite than to skip */
+      if (s->ty == y && s->tx >= 0 && s->tx < x && x - s->tx <= 4) {
+        while (s->tx < x) {
+          put_cell(s, &s->line[y][s->tx]);
+        }
+      }
+      move_to(s, y, x, prefixwidth);
+      put_cell(s, &s->line[y][x]);
+      s->shown[y][x] = s->line[y][x];
+    }
+    s->dirty[y] = 0;
+  }
+
+  set_pen(s, &blank);
+  move_to(s, s->cy, s->cx, prefixwidth);
+  if (s->tcursor_visible != s->cursor_visible) {
+    out_add(s, s->cursor_visible ? "\033[?25h" : "\033[?25l", 6);
+    s->tcursor_visible = s->cursor_visible;
+  }
+}
+
+/**
+ * The program is done. Put the real terminal back in a sane state, with
+ * the cursor on a fresh line below the cursor.
+ */
+void
+screen_leave(struct screen *s)
+{
+  static const char modes[] =
+    "\033[0m\033[?25h\033[?1l\033>"
+    "\033[?1000l\033[?1002l\033[?1003l\033[?1006l\033[?2004l";
+
+  out_add(s, modes, sizeof(modes) - 1);
+  out_printf(s, "\033[%d;%dH\r\n", s->cy + 1, 1);
+}
@@ -0,0 +1,100 @@
+/* ind/screen.h - in-memory terminal screen for --screen
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vt.h"
+
+/* cell attributes: fg and bg are 0-255, or COLOR_DEFAULT */
+#define COLOR_DEFAULT 256
+#define ATTR_BOLD      0x01
+#define ATTR_DIM       0x02
+#define ATTR_ITALIC    0x04
+#define ATTR_UNDERLINE 0x08
+#define ATTR_BLINK     0x10
+#define ATTR_REVERSE   0x20
+#define ATTR_HIDDEN    0x40
+#define ATTR_STRIKE    0x80
+
+struct cell {
+  uint32_t ch;          /* Unicode code point */
+  uint16_t fg;
+  uint16_t bg;
+  uint8_t flags;
+};
+
+struct screen {
+  int rows, cols;
+  struct cell **line;   /* what the program wants shown */
+  struct cell **shown;  /* what the real terminal shows */
+  unsigned char *dirty; /* per row: line and shown may differ */
+  int full;             /* real terminal is in an unknown state */
+
+  /* the program's cursor and pen */
+  int cx, cy;
+  int wrapnext;         /* at the right margin, wrap on next character */
+  struct cell pen;
+  int top, bot;         /* scroll region */
+  int saved_cx, saved_cy;
+  struct cell saved_pen;
+  int cursor_visible;
+  int autowrap;
+
+  /* alternate screen (?1049 and friends): the main screen, saved */
+  struct cell **altsave;
+  int altsave_cx, altsave_cy;
+
+  /* UTF-8 decoding between calls */
+  uint32_t ucs;
+  int uneed;
+
+  struct vt_parser vt;
+
+  /* rendered output, for the caller to write to the terminal */
+  char *out;
+  size_t outlen, outsize;
+
+  /* answers to the program's queries, for the caller to write to it */
+  char reply[64];
+  size_t replylen;
+
+  /* the real terminal's cursor and pen, while rendering */
+  int tx, ty;
+  struct cell tpen;
+  int tcursor_visible;
+};
+
+struct screen *screen_new(int rows, int cols);
+void screen_free(struct screen *s);
+void screen_feed(struct screen *s, const char *p, size_t n);
+void screen_resize(struct screen *s, int rows, int cols);
+int screen_dirty(const struct screen *s);
+void screen_render(struct screen *s, const char *prefix, int prefixwidth);
+void screen_leave(struct screen *s);
@@ -0,0 +1,154 @@
+/* ind/trace.c - main loop timeline, in Chrome trace format
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "trace.h"
+
+/*
+ * Events are kept in memory, and written at the end as the JSON Object
+ * Format that chrome://tracing and ui.perfetto.dev read:
+ *
+ *   {"traceEvents":[
+ *   {"name":"read","ph":"X","ts":12.345,"dur":0.678,"pid":1,"tid":1,
+ *    "args":{"fd":5}},
+ *   ...
+ *   ],"displayTimeUnit":"ms","otherData":{"dropped":"0"}}
+ *
+ * Each event is a complete ("X") event: a start and a duration. Phases
+ * that happen inside others, like a write inside a read, nest in the
+ * viewer by their times.
+ */
+
+/**
+ * @return  CLOCK_MONOTONIC in ns
+ */
+long long
+trace_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Create the trace file now, so a bad path is found before the command
+ * runs rather than after.
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+trace_open(struct tracer *t, const char *path)
+{
+  memset(t, 0, sizeof(*t));
+  if (!(t->f = fopen(path, "w"))) {
+    return -1;
+  }
+  t->epoch = trace_now();
+  return 0;
+}
+
+/**
+ * Add an event that started at start (from trace_now()) and ends now.
+ */
+void
+trace_add(struct tracer *t, const char *name, int fd, long long start)
+{
+  struct trace_event *e;
+
+  if (t->n == t->size) {
+    size_t size = t->size ? t->size * 2 : 4096;
+    struct trace_event *ev;
+
+    if (size > TRACE_MAX_EVENTS) {
+      size = TRACE_MAX_EVENTS;
+    }
+    if (t->n == size || !(ev = realloc(t->ev, size * sizeof(*ev)))) {
+      t->dropped++;
+      return;
+    }
+    t->ev = ev;
+    t->size = size;
+  }
+  e = &t->ev[t->n++];
+  e->name = name;
+  e->fd = fd;
+  e->start = start - t->epoch;
+  e->dur = trace_now() - start;
+}
+
+/**
+ * Write out the events, and free them.
+ *
+ * @param   pid   shown as the process in the viewer
+ *
+ * @return  0 on success, -1 on error (errno set)
+ */
+int
+trace_close(struct tracer *t, long pid)
+{
+  size_t c;
+  int err;
+
+  fputs("{\"traceEvents\":[\n", t->f);
+  for (c = 0; c < t->n; c++) {
+    const struct trace_event *e = &t->ev[c];
+
+    fprintf(t->f, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld.%03lld,"
+            "\"dur\":%lld.%03lld,\"pid\":%ld,\"tid\":%ld",
+            e->name, e->start / 1000, e->start % 1000,
+            e->dur / 1000, e->dur % 1000, pid, pid);
+    if (e->fd >= 0) {
+      fprintf(t->f, ",\"args\":{\"fd\":%d}", e->fd);
+    }
+    fputs(c + 1 < t->n ? "},\n" : "}\n", t->f);
+  }
+  fprintf(t->f, "],\"displayTimeUnit\":\"ms\","
+          "\"otherData\":{\"dropped\":\"%llu\"}}\n", t->dropped);
+  free(t->ev);
+  t->ev = NULL;
+  t->n = t->size = 0;
+
+  err = ferror(t->f);
+  if (fclose(t->f) || err) {
+    if (!errno) {
+      errno = EIO;
+    }
+    return -1;
+  }
+  return 0;
+}
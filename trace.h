@@ -0,0 +1,56 @@
+/* ind/trace.h - main loop timeline, in Chrome trace format
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* at most this many events are kept, the rest are counted and dropped */
+#define TRACE_MAX_EVENTS 1000000
+
+/* one phase of the main loop */
+struct trace_event {
+  const char *name;      /* never freed, so a string literal */
+  int fd;                /* -1 if not about any one fd */
+  long long start;       /* ns since the tracer was opened */
+  long long dur;         /* ns */
+};
+
+struct tracer {
+  FILE *f;
+  long long epoch;       /* CLOCK_MONOTONIC when opened, in ns */
+  struct trace_event *ev;
+  size_t n;
+  size_t size;
+  unsigned long long dropped;
+};
+
+long long trace_now(void);
+int trace_open(struct tracer *t, const char *path);
+void trace_add(struct tracer *t, const char *name, int fd, long long start);
+int trace_close(struct tracer *t, long pid);
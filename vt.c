@@ -0,0 +1,254 @@
+/* ind/vt.c - table-driven VT100/ANSI escape sequence parser
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "vt.h"
+
+/* what to do with a byte, besides changing state */
+enum vt_action {
+  VT_NONE,
+  VT_PRINT,
+  VT_EXECUTE,
+  VT_COLLECT,
+  VT_PARAM,
+  VT_ESC_DISPATCH,
+  VT_CSI_DISPATCH,
+};
+
+/*
+ * One byte per (state, input byte): action in the high nibble, next state
+ * in the low one. Built once, then every input byte costs one lookup.
+ */
+static unsigned char vt_table[VT_NSTATES][256];
+
+/* bytes that are just printed in the ground state */
+static unsigned char vt_printable[256];
+
+#define T(action, state) ((unsigned char)(((action) << 4) | (state)))
+
+/**
+ * Set a range of bytes in one state.
+ */
+static void
+vt_range(int state, int from, int to, int action, int next)
+{
+  int c;
+
+  for (c = from; c <= to; c++) {
+    vt_table[state][c] = T(action, next);
+  }
+}
+
+/**
+ * Fill in the transition table.
+ */
+static void
+vt_build(void)
+{
+  int s;
+
+  for (s = 0; s < VT_NSTATES; s++) {
+    /* by default: stay, ignore */
+    vt_range(s, 0x00, 0xff, VT_NONE, s);
+
+    /* C0 controls are executed in most states */
+    if (s != VT_OSC_STRING && s != VT_IGNORE_STRING) {
+      vt_range(s, 0x00, 0x17, VT_EXECUTE, s);
+      vt_range(s, 0x19, 0x19, VT_EXECUTE, s);
+      vt_range(s, 0x1c, 0x1f, VT_EXECUTE, s);
+    }
+
+    /* "anywhere" transitions */
+    vt_range(s, 0x18, 0x18, VT_EXECUTE, VT_GROUND);
+    vt_range(s, 0x1a, 0x1a, VT_EXECUTE, VT_GROUND);
+    vt_range(s, 0x1b, 0x1b, VT_NONE, VT_ESCAPE);
+  }
+
+  /* ground. 0x80 and up are UTF-8, not C1 controls. */
+  vt_range(VT_GROUND, 0x20, 0x7e, VT_PRINT, VT_GROUND);
+  vt_range(VT_GROUND, 0x80, 0xff, VT_PRINT, VT_GROUND);
+
+  /* ESC */
+  vt_range(VT_ESCAPE, 0x20, 0x2f, VT_COLLECT, VT_ESCAPE_INTER);
+  vt_range(VT_ESCAPE, 0x30, 0x7e, VT_ESC_DISPATCH, VT_GROUND);
+  vt_range(VT_ESCAPE, 0x5b, 0x5b, VT_NONE, VT_CSI_ENTRY);
+  vt_range(VT_ESCAPE, 0x5d, 0x5d, VT_NONE, VT_OSC_STRING);
+  vt_range(VT_ESCAPE, 0x50, 0x50, VT_NONE, VT_IGNORE_STRING);
+  vt_range(VT_ESCAPE, 0x58, 0x58, VT_NONE, VT_IGNORE_STRING);
+  vt_range(VT_ESCAPE, 0x5e, 0x5f, VT_NONE, VT_IGNORE_STRING);
+
+  vt_range(VT_ESCAPE_INTER, 0x20, 0x2f, VT_COLLECT, VT_ESCAPE_INTER);
+  vt_range(VT_ESCAPE_INTER, 0x30, 0x7e, VT_ESC_DISPATCH, VT_GROUND);
+
+  /* CSI */
+  vt_range(VT_CSI_ENTRY, 0x20, 0x2f, VT_COLLECT, VT_CSI_INTER);
+  vt_range(VT_CSI_ENTRY, 0x30, 0x39, VT_PARAM, VT_CSI_PARAM);
+  vt_range(VT_CSI_ENTRY, 0x3a, 0x3b, VT_PARAM, VT_CSI_PARAM);
+  vt_range(VT_CSI_ENTRY, 0x3c, 0x3f, VT_COLLECT, VT_CSI_PARAM);
+  vt_range(VT_CSI_ENTRY, 0x40, 0x7e, VT_CSI_DISPATCH, VT_GROUND);
+
+  vt_range(VT_CSI_PARAM, 0x20, 0x2f, VT_COLLECT, VT_CSI_INTER);
+  vt_range(VT_CSI_PARAM, 0x30, 0x3b, VT_PARAM, VT_CSI_PARAM);
+  vt_range(VT_CSI_PARAM, 0x3c, 0x3f, VT_NONE, VT_CSI_IGNORE);
+  vt_range(VT_CSI_PARAM, 0x40, 0x7e, VT_CSI_DISPATCH, VT_GROUND);
+
+  vt_range(VT_CSI_INTER, 0x20, 0x2f, VT_COLLECT, VT_CSI_INTER);
+  vt_range(VT_CSI_INTER, 0x30, 0x3f, VT_NONE, VT_CSI_IGNORE);
+  vt_range(VT_CSI_INTER, 0x40, 0x7e, VT_CSI_DISPATCH, VT_GROUND);
+
+  vt_range(VT_CSI_IGNORE, 0x40, 0x7e, VT_NONE, VT_GROUND);
+
+  /* OSC ends with BEL (xterm) or ST (ESC \, via the ESC state) */
+  vt_range(VT_OSC_STRING, 0x07, 0x07, VT_NONE, VT_GROUND);
+
+  /* the other strings only end with ST */
+
+  for (s = 0; s < 256; s++) {
+    vt_printable[s] = (vt_table[VT_GROUND][s] >> 4) == VT_PRINT;
+  }
+}
+
+/**
+ * Set up a parser.
+ *
+ * @param   vt    parser to set up
+ * @param   cb    what to call for the things found
+ * @param   ctx   first argument to the callbacks
+ */
+void
+vt_init(struct vt_parser *vt, const struct vt_callbacks *cb, void *ctx)
+{
+  if (!vt_printable['a']) {
+    vt_build();
+  }
+  memset(vt, 0, sizeof(struct vt_parser));
+  vt->state = VT_GROUND;
+  vt->cb = cb;
+  vt->ctx = ctx;
+}
+
+/**
+ * Forget the sequence collected so far. Done on entering ESC or CSI.
+ */
+static void
+vt_clear(struct vt_parser *vt)
+{
+  vt->priv = 0;
+  vt->ninter = 0;
+  vt->nparams = 0;
+}
+
+/**
+ * Feed the parser. Sequences may be split anywhere between calls.
+ */
+void
+vt_feed(struct vt_parser *vt, const char *buf, size_t n)
+{
+  const unsigned char *p = (const unsigned char*)buf;
+  const unsigned char *end = p + n;
+
+  while (p < end) {
+    unsigned char t;
+    int c;
+
+    /* fast path: runs of text */
+    if (vt->state == VT_GROUND && vt_printable[*p]) {
+      const unsigned char *q = p + 1;
+      while (q < end && vt_printable[*q]) {
+        q++;
+      }
+      if (vt->cb->print) {
+        vt->cb->print(vt->ctx, (const char*)p, q - p);
+      }
+      p = q;
+      continue;
+    }
+
+    c = *p++;
+    t = vt_table[vt->state][c];
+
+    switch (t >> 4) {
+    case VT_PRINT:
+      /* can't happen, handled above */
+      break;
+    case VT_EXECUTE:
+      if (vt->cb->execute) {
+        vt->cb->execute(vt->ctx, c);
+      }
+      break;
+    case VT_COLLECT:
+      if (c >= 0x3c && c <= 0x3f) {
+        vt->priv = c;
+      } else if (vt->ninter < VT_MAX_INTER) {
+        vt->inter[vt->ninter++] = c;
+      }
+      break;
+    case VT_PARAM:
+      if (!vt->nparams) {
+        vt->params[vt->nparams++] = -1;
+      }
+      if (c == ';' || c == ':') {
+        if (vt->nparams < VT_MAX_PARAMS) {
+          vt->params[vt->nparams++] = -1;
+        }
+      } else {
+        int *v = &vt->params[vt->nparams - 1];
+        if (*v < 0) {
+          *v = 0;
+        }
+        if (*v < 65536) {
+          *v = *v * 10 + (c - '0');
+        }
+      }
+      break;
+    case VT_ESC_DISPATCH:
+      if (vt->cb->esc) {
+        vt->cb->esc(vt->ctx, c, vt->inter, vt->ninter);
+      }
+      break;
+    case VT_CSI_DISPATCH:
+      if (vt->cb->csi) {
+        vt->cb->csi(vt->ctx, c, vt->priv, vt->params, vt->nparams,
+                    vt->inter, vt->ninter);
+      }
+      break;
+    }
+
+    if ((t & 0x0f) != vt->state) {
+      vt->state = t & 0x0f;
+      if (vt->state == VT_ESCAPE || vt->state == VT_CSI_ENTRY) {
+        vt_clear(vt);
+      }
+    }
+  }
+}
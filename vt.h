@@ -0,0 +1,77 @@
+/* ind/vt.h - table-driven VT100/ANSI escape sequence parser
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+
+/*
+ * The state machine is the one from Paul Williams' "A parser for DEC's
+ * ANSI-compatible video terminals" (vt100.net/emu/dec_ansi_parser),
+ * minus DCS passthrough, which is ignored like SOS/PM/APC.
+ */
+enum vt_state {
+  VT_GROUND,
+  VT_ESCAPE,
+  VT_ESCAPE_INTER,
+  VT_CSI_ENTRY,
+  VT_CSI_PARAM,
+  VT_CSI_INTER,
+  VT_CSI_IGNORE,
+  VT_OSC_STRING,
+  VT_IGNORE_STRING,    /* DCS, SOS, PM, APC */
+  VT_NSTATES
+};
+
+#define VT_MAX_PARAMS 16
+#define VT_MAX_INTER 2
+
+struct vt_callbacks {
+  /* run of printable bytes (including UTF-8) */
+  void (*print)(void *ctx, const char *p, size_t n);
+  /* C0 control character */
+  void (*execute)(void *ctx, int c);
+  /* ESC <inter> <final> */
+  void (*esc)(void *ctx, int final, const char *inter, int ninter);
+  /* CSI <private> <params> <inter> <final>. Missing params are -1. */
+  void (*csi)(void *ctx, int final, int priv, const int *params, int nparams,
+              const char *inter, int ninter);
+};
+
+struct vt_parser {
+  unsigned char state;
+  char priv;                   /* '?', '>', ... or 0 */
+  unsigned char ninter;
+  unsigned char nparams;
+  char inter[VT_MAX_INTER];
+  int params[VT_MAX_PARAMS];
+  const struct vt_callbacks *cb;
+  void *ctx;
+};
+
+void vt_init(struct vt_parser *vt, const struct vt_callbacks *cb, void *ctx);
+void vt_feed(struct vt_parser *vt, const char *p, size_t n);
@@ -0,0 +1,138 @@
+/* ind/width.c - display width of characters
+ *
+ * (BSD license without advertising clause below)
+ *
+ * Copyright (c) 2005-2008 Thomas Habets. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "width.h"
+
+/*
+ * Like wcwidth(), but without depending on the locale, which ind never
+ * sets. Ranges are from Unicode's EastAsianWidth.txt (W and F) and the
+ * nonspacing marks, merged where close enough.
+ */
+struct width_range {
+  uint32_t first;
+  uint32_t last;
+};
+
+/* combining marks and other zero width characters */
+static const struct width_range zero_width[] = {
+  { 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd },
+  { 0x05bf, 0x05bf }, { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 },
+  { 0x05c7, 0x05c7 }, { 0x0610, 0x061a }, { 0x064b, 0x065f },
+  { 0x0670, 0x0670 }, { 0x06d6, 0x06dc }, { 0x06df, 0x06e4 },
+  { 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed }, { 0x0711, 0x0711 },
+  { 0x0730, 0x074a }, { 0x07a6, 0x07b0 }, { 0x0901, 0x0902 },
+  { 0x093c, 0x093c }, { 0x0941, 0x0948 }, { 0x094d, 0x094d },
+  { 0x0951, 0x0954 }, { 0x0962, 0x0963 }, { 0x0e31, 0x0e31 },
+  { 0x0e34, 0x0e3a }, { 0x0e47, 0x0e4e }, { 0x0eb1, 0x0eb1 },
+  { 0x0eb4, 0x0ebc }, { 0x0ec8, 0x0ecd }, { 0x1160, 0x11ff },
+  { 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff }, { 0x200b, 0x200f },
+  { 0x202a, 0x202e }, { 0x2060, 0x2064 }, { 0x20d0, 0x20ff },
+  { 0x302a, 0x302d }, { 0x3099, 0x309a }, { 0xfe00, 0xfe0f },
+  { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff }, { 0xe0001, 0xe007f },
+  { 0xe0100, 0xe01ef },
+};
+
+/* characters taking two columns */
+static const struct width_range double_width[] = {
+  { 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a },
+  { 0x23e9, 0x23ec }, { 0x23f0, 0x23f0 }, { 0x23f3, 0x23f3 },
+  { 0x25fd, 0x25fe }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 },
+  { 0x267f, 0x267f }, { 0x2693, 0x2693 }, { 0x26a1, 0x26a1 },
+  { 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 },
+  { 0x26ce, 0x26ce }, { 0x26d4, 0x26d4 }, { 0x26ea, 0x26ea },
+  { 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 }, { 0x26fa, 0x26fa },
+  { 0x26fd, 0x26fd }, { 0x2705, 0x2705 }, { 0x270a, 0x270b },
+  { 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x274e, 0x274e },
+  { 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+  { 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf }, { 0x2b1b, 0x2b1c },
+  { 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 }, { 0x2e80, 0x3029 },
+  { 0x302e, 0x303e }, { 0x3041, 0x3098 }, { 0x309b, 0x4dbf },
+  { 0x4e00, 0xa4cf }, { 0xa960, 0xa97f }, { 0xac00, 0xd7a3 },
+  { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 }, { 0xfe30, 0xfe6f },
+  { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x16fe0, 0x16fe4 },
+  { 0x17000, 0x18aff }, { 0x1b000, 0x1b2ff }, { 0x1f004, 0x1f004 },
+  { 0x1f0cf, 0x1f0cf }, { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a },
+  { 0x1f200, 0x1f251 }, { 0x1f300, 0x1f64f }, { 0x1f680, 0x1f6ff },
+  { 0x1f7e0, 0x1f7eb }, { 0x1f90c, 0x1f9ff }, { 0x1fa70, 0x1faff },
+  { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+};
+
+/**
+ * @return  1 if c is in the sorted table
+ */
+static int
+in_table(uint32_t c, const struct width_range *t, int n)
+{
+  int lo = 0;
+  int hi = n - 1;
+
+  if (c < t[0].first || c > t[n - 1].last) {
+    return 0;
+  }
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (c > t[mid].last) {
+      lo = mid + 1;
+    } else if (c < t[mid].first) {
+      hi = mid - 1;
+    } else {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * How many columns a character takes on a terminal.
+ *
+ * @param   c   Unicode code point
+ *
+ * @return  0, 1 or 2. Control characters are 0.
+ */
+int
+char_width(uint32_t c)
+{
+  if (c >= 0x20 && c < 0x7f) {
+    return 1;
+  }
+  if (c < 0x20 || (c >= 0x7f && c < 0xa0)) {
+    return 0;
+  }
+  if (in_table(c, zero_width, sizeof(zero_width) / sizeof(zero_width[0]))) {
+    return 0;
+  }
+  if (in_table(c, double_width,
+               sizeof(double_width) / sizeof(double_width[0]))) {
+    return 2;
+  }
+  return 1;
+}